@@ -13,12 +13,14 @@ typedef enum
 } HttpRecvStatu;
 
 #define MAX_LINE 8192
+#define HEAD_SCAN_BATCH 128 // 解析头部时一次扫描最多记录的分隔符个数
 class HttpContext
 {
 private:
     int _resp_statu;           // 响应状态码
     HttpRecvStatu _recv_statu; // 当前接收及解析的阶段状态
     HttpRequest _request;      // 已经解析得到的请求信息
+    bool _busy;                // 当前请求正在业务线程池中处理，处理完之前不解析后面的请求，保证响应的顺序
 private:
     bool ParseHttpLine(const std::string &line)
     {
@@ -102,60 +104,87 @@ private:
     {
         if (_recv_statu != RECV_HTTP_HEAD)
             return false;
-        // 一行一行取出数据，直到遇到空行为止， 头部的格式 key: val\r\nkey: val\r\n....
-        while (1)
+        // 头部的格式 key: val\r\nkey: val\r\n....\r\n，以空行结束
+        // 先定位"\r\n\r\n"，头部完整时只扫描头部，不会扫描到后面的正文；没找到（头部还没收全，或者只用\n换行）就扫描全部数据
+        const char *data = buf->ReadPosition();
+        size_t len = buf->ReadAbleSize();
+        const char *end = buf->FindDoubleCRLF();
+        if (end != NULL)
+            len = end - data + 4;
+        // 一遍扫描同时找出每一行的':'和'\n'，在缓冲区中直接解析，不需要每行一次查找和一个临时字符串
+        size_t offsets[HEAD_SCAN_BATCH];
+        size_t pos = 0, line = 0, colon = std::string::npos;
+        while (pos < len)
         {
-            std::string line = buf->GetLineAndPop();
-            // 2. 需要考虑的一些要素：缓冲区中的数据不足一行， 获取的一行数据超大
-            if (line.size() == 0)
+            size_t n = ByteScan::FindAny(data + pos, len - pos, ":\n", 2, offsets, HEAD_SCAN_BATCH);
+            for (size_t i = 0; i < n; i++)
             {
-                // 缓冲区中的数据不足一行，则需要判断缓冲区的可读数据长度，如果很长了都不足一行，这是有问题的
-                if (buf->ReadAbleSize() > MAX_LINE)
+                size_t off = pos + offsets[i];
+                if (data[off] == ':')
                 {
+                    // 只需要每一行的第一个':'
+                    if (colon == std::string::npos)
+                        colon = off - line;
+                    continue;
+                }
+                // 2. 需要考虑的一些要素：获取的一行数据超大
+                if (off + 1 - line > MAX_LINE)
+                {
+                    buf->MoveReadOffset(off + 1);
                     _recv_statu = RECV_HTTP_ERROR;
                     _resp_statu = 414; // URI TOO LONG
                     return false;
                 }
-                // 缓冲区中数据不足一行，但是也不多，就等等新数据的到来
-                return true;
-            }
-            if (line.size() > MAX_LINE)
-            {
-                _recv_statu = RECV_HTTP_ERROR;
-                _resp_statu = 414; // URI TOO LONG
-                return false;
+                size_t size = off - line; // 去掉末尾的换行字符
+                if (size > 0 && data[off - 1] == '\r')
+                    size--; // 末尾是回车则去掉回车字符
+                if (size == 0)
+                {
+                    // 空行，头部处理完毕，进入正文获取阶段
+                    buf->MoveReadOffset(off + 1);
+                    _recv_statu = RECV_HTTP_BODY;
+                    return true;
+                }
+                if (ParseHttpHead(data + line, size, colon) == false)
+                {
+                    buf->MoveReadOffset(off + 1);
+                    return false;
+                }
+                line = off + 1;
+                colon = std::string::npos;
             }
-            if (line == "\n" || line == "\r\n")
-            {
+            if (n < HEAD_SCAN_BATCH)
                 break;
-            }
-            bool ret = ParseHttpHead(line);
-            if (ret == false)
-            {
-                return false;
-            }
+            pos += offsets[n - 1] + 1;
+        }
+        buf->MoveReadOffset(line);
+        // 缓冲区中的数据不足一行，则需要判断缓冲区的可读数据长度，如果很长了都不足一行，这是有问题的
+        if (buf->ReadAbleSize() > MAX_LINE)
+        {
+            _recv_statu = RECV_HTTP_ERROR;
+            _resp_statu = 414; // URI TOO LONG
+            return false;
         }
-        // 头部处理完毕，进入正文获取阶段
-        _recv_statu = RECV_HTTP_BODY;
+        // 缓冲区中数据不足一行，但是也不多，就等等新数据的到来
         return true;
     }
-    bool ParseHttpHead(std::string &line)
+    // line是去掉了换行的一行，colon是其中第一个':'的位置（没有为npos）
+    bool ParseHttpHead(const char *line, size_t size, size_t colon)
     {
-        // key: val\r\nkey: val\r\n....
-        if (line.back() == '\n')
-            line.pop_back(); // 末尾是换行则去掉换行字符
-        if (line.back() == '\r')
-            line.pop_back(); // 末尾是回车则去掉回车字符
-
-        size_t pos = line.find(": ");
-        if (pos == std::string::npos)
+        // key: val，通常第一个':'后面就是空格，否则再查找": "
+        if (colon == std::string::npos || colon + 1 >= size || line[colon + 1] != ' ')
         {
-            _recv_statu = RECV_HTTP_ERROR;
-            _resp_statu = 400; //
-            return false;
+            const char *pos = (const char *)memmem(line, size, ": ", 2);
+            if (pos == NULL)
+            {
+                _recv_statu = RECV_HTTP_ERROR;
+                _resp_statu = 400; //
+                return false;
+            }
+            colon = pos - line;
         }
-        std::string key = line.substr(0, pos);
-        std::string val = line.substr(pos + 2);
+        std::string key(line, colon);
+        std::string val(line + colon + 2, size - colon - 2);
         _request.SetHeader(key, val);
         return true;
     }
@@ -189,7 +218,9 @@ private:
     }
 
 public:
-    HttpContext() : _resp_statu(200), _recv_statu(RECV_HTTP_LINE) {}
+    HttpContext() : _resp_statu(200), _recv_statu(RECV_HTTP_LINE), _busy(false) {}
+    bool Busy() { return _busy; }
+    void SetBusy(bool busy) { _busy = busy; }
     void ReSet()
     {
         _resp_statu = 200;
@@ -206,9 +237,9 @@ public:
         switch (_recv_statu)
         {
         case RECV_HTTP_LINE:
-            RecvHttpLine(buf);
+            RecvHttpLine(buf); // fall through
         case RECV_HTTP_HEAD:
-            RecvHttpHead(buf);
+            RecvHttpHead(buf); // fall through
         case RECV_HTTP_BODY:
             RecvHttpBody(buf);
         }
@@ -177,6 +177,29 @@ private:
         conn->SetContext(HttpContext());
         DBG_LOG("NEW CONNECTION %p", conn.get());
     }
+    // 在业务线程池中进行路由和业务处理，完成之后回到连接所属的EventLoop中发送响应
+    void Offload(const PtrConnection &conn, HttpContext *context)
+    {
+        context->SetBusy(true);
+        std::shared_ptr<HttpRequest> req(new HttpRequest(context->Request()));
+        int statu = context->RespStatu();
+        _server.RunInWorker([this, conn, req, statu]()
+                            {
+                                std::shared_ptr<HttpResponse> rsp(new HttpResponse(statu));
+                                Route(*req, rsp.get());
+                                conn->GetLoop()->RunInLoop([this, conn, req, rsp]()
+                                                           { FinishOffload(conn, *req, *rsp); }); });
+    }
+    void FinishOffload(const PtrConnection &conn, const HttpRequest &req, HttpResponse &rsp)
+    {
+        HttpContext *context = conn->GetContext()->get<HttpContext>();
+        WriteReponse(conn, req, rsp);
+        context->ReSet();
+        context->SetBusy(false);
+        if (rsp.Close() == true)
+            return conn->Shutdown();
+        conn->Resume(); // 继续处理流水线中后面的请求
+    }
     // 缓冲区数据解析+处理
     void OnMessage(const PtrConnection &conn, Buffer *buffer)
     {
@@ -184,6 +207,10 @@ private:
         {
             // 1. 获取上下文
             HttpContext *context = conn->GetContext()->get<HttpContext>();
+            if (context->Busy())
+            {
+                return; // 上一个请求还在业务线程池中处理，处理完之后会重新处理缓冲区中的数据
+            }
             // 2. 通过上下文对缓冲区数据进行解析，得到HttpRequest对象
             //   1. 如果缓冲区的数据解析出错，就直接回复出错响应
             //   2. 如果解析正常，且请求已经获取完毕，才开始去进行处理
@@ -206,6 +233,11 @@ private:
                 return;
             }
             // 3. 请求路由 + 业务处理
+            if (_server.HasWorkers())
+            {
+                // 交给业务线程池处理，EventLoop线程继续处理其他连接的IO
+                return Offload(conn, context);
+            }
             Route(req, &rsp);
             // 4. 对HttpResponse进行组织发送
             WriteReponse(conn, req, rsp);
@@ -214,12 +246,15 @@ private:
             // 6. 根据长短连接判断是否关闭连接或者继续处理
             if (rsp.Close() == true)
                 conn->Shutdown(); // 短链接则直接关闭
+            // 7. 本次的消息预算用完了，剩下的请求稍后再处理，避免流水线请求占用EventLoop太久
+            if (conn->ConsumeMessageBudget() == false)
+                return;
         }
         return;
     }
 
 public:
-    HttpServer(int port, int timeout = DEFALT_TIMEOUT) : _server(port)
+    HttpServer(int port, int timeout = DEFALT_TIMEOUT, PollerType type = POLLER_EPOLL) : _server(port, type)
     {
         _server.EnableInactiveRelease(timeout);
         _server.SetConnectedCallback(std::bind(&HttpServer::OnConnected, this, std::placeholders::_1));
@@ -251,6 +286,65 @@ public:
     {
         _server.SetThreadCount(count);
     }
+    // 业务线程数，设置之后请求处理函数都在业务线程池中执行，不会阻塞IO；同一个连接的请求仍然按顺序处理
+    void SetWorkerThreadCount(int count)
+    {
+        _server.SetWorkerThreadCount(count);
+    }
+    // 使用边沿触发，大请求体一次事件就能读完
+    void EnableEdgeTrigger()
+    {
+        _server.EnableEdgeTrigger();
+    }
+    // 每个连接一次事件最多读取bytes字节、处理messages个请求，0表示不限制
+    void SetEventBudget(size_t bytes, uint32_t messages)
+    {
+        _server.SetEventBudget(bytes, messages);
+    }
+    // 不使用timerfd，定时器由事件监控的超时时间驱动，每个线程少一次唤醒和两次系统调用
+    void EnableInlineTimer()
+    {
+        _server.EnableInlineTimer();
+    }
+    // 从属线程阻塞之前最多空转us微秒
+    void SetBusyPoll(uint32_t us)
+    {
+        _server.SetBusyPoll(us);
+    }
+    LoopPollStats PollStats()
+    {
+        return _server.PollStats();
+    }
+    void SetCpuAffinity(int base_cpu, const std::vector<int> &cpus)
+    {
+        _server.SetCpuAffinity(base_cpu, cpus);
+    }
+    void EnableAutoPlacement()
+    {
+        _server.EnableAutoPlacement();
+    }
+    void EnableLoopStats()
+    {
+        _server.EnableLoopStats();
+    }
+    std::vector<LoopStatsSnapshot> LoopStatsSnapshots()
+    {
+        return _server.LoopStatsSnapshots();
+    }
+    // 一个请求处理函数（或者其他回调）执行超过ms毫秒就报告卡顿，需要在Listen之前调用
+    void EnableWatchdog(uint32_t ms, bool backtrace = false)
+    {
+        _server.EnableWatchdog(ms, backtrace);
+    }
+    uint64_t StallCount()
+    {
+        return _server.StallCount();
+    }
+    // 连接空闲idle_ms毫秒释放缓冲区多余的内存，处理完的输入缓冲区超过threshold字节立即释放，需要在Listen之前调用
+    void EnableBufferShrink(uint32_t idle_ms, uint64_t threshold = 64 * 1024)
+    {
+        _server.EnableBufferShrink(idle_ms, threshold);
+    }
     void Listen()
     {
         _server.Start();
@@ -25,6 +25,12 @@ private:
         if (_accept_callback)
             _accept_callback(newfd);
     }
+    /*io_uring后端使用多次accept，新连接由内核直接给出*/
+    void HandleAccept(int newfd)
+    {
+        if (_accept_callback)
+            _accept_callback(newfd);
+    }
     int CreateServer(int port)
     {
         bool ret = _socket.CreateServer(port);
@@ -40,6 +46,7 @@ public:
                                           _channel(loop, _socket.Fd())
     {
         _channel.SetReadCallback(std::bind(&Acceptor::HandleRead, this));
+        _channel.SetAcceptCallback(std::bind(&Acceptor::HandleAccept, this, std::placeholders::_1));
     }
     void SetAcceptCallback(const AcceptCallback &cb) { _accept_callback = cb; }
     void Listen() { _channel.EnableRead(); }
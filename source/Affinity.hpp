@@ -0,0 +1,197 @@
+#pragma once
+
+#include "Log.hpp"
+
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <string.h>
+
+/*CPU拓扑：从sysfs读取每个CPU所属的物理核心、插槽以及NUMA结点，用于把EventLoop线程绑定到合适的核心上
+ * 线程绑定之后，默认的内存策略就是从本结点分配（首次访问的页面落在本结点），
+ * 所以只要让Connection、缓冲区在所属EventLoop线程中分配，就能保证它们都在本结点的内存上。*/
+class CpuTopology
+{
+public:
+    struct CpuInfo
+    {
+        int cpu;
+        int core;    // 物理核心编号（同一插槽内唯一）
+        int package; // 插槽编号
+        int node;    // NUMA结点编号
+    };
+
+private:
+    static int ReadInt(const std::string &path, int def)
+    {
+        FILE *fp = fopen(path.c_str(), "r");
+        if (fp == NULL)
+            return def;
+        int value = def;
+        if (fscanf(fp, "%d", &value) != 1)
+            value = def;
+        fclose(fp);
+        return value;
+    }
+    // 解析"0-3,8-11"格式的CPU列表
+    static std::vector<int> ParseCpuList(const std::string &path)
+    {
+        std::vector<int> cpus;
+        FILE *fp = fopen(path.c_str(), "r");
+        if (fp == NULL)
+            return cpus;
+        char buf[4096] = {0};
+        if (fgets(buf, sizeof(buf), fp) == NULL)
+            buf[0] = 0;
+        fclose(fp);
+        char *p = buf;
+        while (*p)
+        {
+            char *end;
+            long first = strtol(p, &end, 10);
+            if (end == p)
+                break;
+            long last = first;
+            if (*end == '-')
+            {
+                p = end + 1;
+                last = strtol(p, &end, 10);
+            }
+            for (long i = first; i <= last; i++)
+                cpus.push_back((int)i);
+            p = end;
+            if (*p == ',')
+                p++;
+        }
+        return cpus;
+    }
+    // cpu -> NUMA结点，没有NUMA信息的机器全部视为结点0
+    static std::map<int, int> LoadNodes()
+    {
+        std::map<int, int> nodes;
+        DIR *dir = opendir("/sys/devices/system/node");
+        if (dir == NULL)
+            return nodes;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            int node;
+            if (sscanf(entry->d_name, "node%d", &node) != 1)
+                continue;
+            std::vector<int> cpus = ParseCpuList(std::string("/sys/devices/system/node/") + entry->d_name + "/cpulist");
+            for (auto cpu : cpus)
+                nodes[cpu] = node;
+        }
+        closedir(dir);
+        return nodes;
+    }
+
+public:
+    // 当前进程允许使用的所有CPU的拓扑信息
+    static std::vector<CpuInfo> Load()
+    {
+        std::vector<CpuInfo> infos;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) < 0)
+            return infos;
+        std::map<int, int> nodes = LoadNodes();
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (!CPU_ISSET(cpu, &set))
+                continue;
+            std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+            CpuInfo info;
+            info.cpu = cpu;
+            info.core = ReadInt(dir + "core_id", cpu);
+            info.package = ReadInt(dir + "physical_package_id", 0);
+            info.node = nodes.count(cpu) ? nodes[cpu] : 0;
+            infos.push_back(info);
+        }
+        return infos;
+    }
+    /*自动分布的CPU顺序：轮流从各个NUMA结点中取，每个结点先取各物理核心的第一个超线程，再取其余的超线程
+     * 依次把EventLoop绑定到返回的CPU上，线程就会均匀地分布在各个结点的不同物理核心上*/
+    static std::vector<int> SpreadCpus()
+    {
+        std::vector<CpuInfo> infos = Load();
+        std::map<int, std::vector<int>> primary, secondary; // node -> cpus
+        std::map<std::pair<int, int>, bool> seen;            // (package, core)是否已经取过
+        for (auto &info : infos)
+        {
+            std::pair<int, int> core(info.package, info.core);
+            if (seen.count(core))
+            {
+                primary[info.node]; // 保证每个结点都出现在primary中
+                secondary[info.node].push_back(info.cpu);
+                continue;
+            }
+            seen[core] = true;
+            primary[info.node].push_back(info.cpu);
+        }
+        std::vector<std::vector<int>> lists;
+        for (auto &it : primary)
+        {
+            std::vector<int> cpus = it.second;
+            cpus.insert(cpus.end(), secondary[it.first].begin(), secondary[it.first].end());
+            lists.push_back(cpus);
+        }
+        std::vector<int> order;
+        for (size_t i = 0; order.size() < infos.size(); i++)
+        {
+            for (auto &cpus : lists)
+            {
+                if (i < cpus.size())
+                    order.push_back(cpus[i]);
+            }
+        }
+        return order;
+    }
+    // 进程最初允许使用的CPU：第一次绑定之前记录下来（新线程会继承创建者的绑定，之后再查询得到的就不是了）
+    static const cpu_set_t &ProcessMask()
+    {
+        static const cpu_set_t mask = []()
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if (sched_getaffinity(0, sizeof(set), &set) < 0)
+            {
+                for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                    CPU_SET(cpu, &set);
+            }
+            return set;
+        }();
+        return mask;
+    }
+    // 把调用线程绑定到指定的CPU上
+    static bool PinCurrentThread(int cpu)
+    {
+        ProcessMask();
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (ret != 0)
+        {
+            ERR_LOG("BIND THREAD TO CPU %d FAILED: %s", cpu, strerror(ret));
+            return false;
+        }
+        return true;
+    }
+    // 解除调用线程从创建者那里继承来的绑定，恢复为进程最初允许使用的CPU
+    static bool UnpinCurrentThread()
+    {
+        int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &ProcessMask());
+        if (ret != 0)
+        {
+            ERR_LOG("UNBIND THREAD FAILED: %s", strerror(ret));
+            return false;
+        }
+        return true;
+    }
+};
@@ -1,23 +1,99 @@
 #pragma once
 
-#include <vector>
+#include <algorithm>
 #include <cassert>
 #include <string>
 #include <cstring>
+#include <sys/uio.h>
 
 #include "Log.hpp"
+#include "BufferPool.hpp"
+#include "ByteScan.hpp"
 
 #define BUFFER_DEFAULT_SIZE 1024
+#define BUFFER_SPILL_SIZE 65536 // ReadFromFd中栈上溢出区的大小
+/*内存从当前线程的BufferPool中分配，大小总是2的幂；第一次写入时才分配，
+ * 没有写入过数据的缓冲区（比如连接还没有收到数据）不占用内存*/
 class Buffer
 {
 private:
-    std::vector<char> _buffer; // 使用vector进行内存空间管理
-    uint64_t _reader_idx;      // 读偏移
-    uint64_t _writer_idx;      // 写偏移
+    char *_buffer;        // 从BufferPool分配的内存块，没有分配时为NULL
+    uint64_t _capacity;   // 内存块大小
+    uint64_t _reader_idx; // 读偏移
+    uint64_t _writer_idx; // 写偏移
+
+private:
+    // 换成一块至少size字节的新内存块，可读数据移动到起始位置
+    void Reallocate(uint64_t size)
+    {
+        uint64_t rsz = ReadAbleSize();
+        uint64_t capacity = 0;
+        char *block = BufferPool::LocalAlloc(size, &capacity);
+        if (rsz > 0)
+            memcpy(block, ReadPosition(), rsz);
+        Release();
+        _buffer = block;
+        _capacity = capacity;
+        _reader_idx = 0;
+        _writer_idx = rsz;
+    }
+    // 内存块还给BufferPool
+    void Release()
+    {
+        if (_buffer)
+            BufferPool::LocalFree(_buffer, _capacity);
+        _buffer = NULL;
+        _capacity = 0;
+    }
+
 public:
-    Buffer() : _reader_idx(0), _writer_idx(0), _buffer(BUFFER_DEFAULT_SIZE) {}
+    Buffer() : _buffer(NULL), _capacity(0), _reader_idx(0), _writer_idx(0) {}
+    // 复制只复制可读数据
+    Buffer(const Buffer &other) : _buffer(NULL), _capacity(0), _reader_idx(0), _writer_idx(0)
+    {
+        uint64_t rsz = other._writer_idx - other._reader_idx;
+        if (rsz > 0)
+            WriteAndPush(other._buffer + other._reader_idx, rsz);
+    }
+    Buffer(Buffer &&other) : _buffer(other._buffer), _capacity(other._capacity),
+                             _reader_idx(other._reader_idx), _writer_idx(other._writer_idx)
+    {
+        other._buffer = NULL;
+        other._capacity = 0;
+        other._reader_idx = other._writer_idx = 0;
+    }
+    Buffer &operator=(const Buffer &other)
+    {
+        if (this != &other)
+        {
+            Clear();
+            uint64_t rsz = other._writer_idx - other._reader_idx;
+            if (rsz > 0)
+                WriteAndPush(other._buffer + other._reader_idx, rsz);
+        }
+        return *this;
+    }
+    Buffer &operator=(Buffer &&other)
+    {
+        if (this != &other)
+        {
+            Release();
+            _buffer = other._buffer;
+            _capacity = other._capacity;
+            _reader_idx = other._reader_idx;
+            _writer_idx = other._writer_idx;
+            other._buffer = NULL;
+            other._capacity = 0;
+            other._reader_idx = other._writer_idx = 0;
+        }
+        return *this;
+    }
+    ~Buffer() { Release(); }
 
-    char *Begin() { return &*_buffer.begin(); }
+    char *Begin() { return _buffer; }
+
+    // 内存块大小
+    uint64_t Capacity() { return _capacity; }
 
     // 获取当前写入起始地址, _buffer的空间起始地址，加上写偏移量
     char *WritePosition() { return Begin() + _writer_idx; }
@@ -26,7 +102,7 @@ public:
     char *ReadPosition() { return Begin() + _reader_idx; }
 
     // 获取缓冲区末尾空闲空间大小--写偏移之后的空闲空间, 总体空间大小减去写偏移00
-    uint64_t TailIdleSize() { return _buffer.size() - _writer_idx; }
+    uint64_t TailIdleSize() { return _capacity - _writer_idx; }
 
     // 获取缓冲区起始空闲空间大小--读偏移之前的空闲空间
     uint64_t HeadIdleSize() { return _reader_idx; }
@@ -69,11 +145,18 @@ public:
             _reader_idx = 0;                                          // 将读偏移归0
             _writer_idx = rsz;                                        // 将写位置置为可读数据大小， 因为当前的可读数据大小就是写偏移量
         }
+        else if (_buffer == NULL)
+        {
+            // 第一次写入，按需要的大小分配
+            Reallocate(len);
+        }
         else
         {
-            // 总体空间不够，则需要扩容，不移动数据，直接给写偏移之后扩容足够空间即可
-            DBG_LOG("RESIZE %ld", _writer_idx + len);
-            _buffer.resize(_writer_idx + len);
+            // 总体空间不够，则需要扩容：换一块能放下可读数据和新数据的内存块，至少是原来的两倍
+            uint64_t size = ReadAbleSize() + len;
+            size = size > _capacity * 2 ? size : _capacity * 2;
+            DBG_LOG("RESIZE %ld", size);
+            Reallocate(size);
         }
     }
 
@@ -150,10 +233,20 @@ public:
 
     char *FindCRLF()
     {
+        if (ReadAbleSize() == 0)
+            return NULL;
         char *res = (char *)memchr(ReadPosition(), '\n', ReadAbleSize()); // memchr在指定的内存区域中查找某个字符第一次出现的位置
         return res;
     }
 
+    // 查找第一个"\r\n\r\n"（HTTP头部的结尾），返回它的起始地址，没找到返回NULL
+    char *FindDoubleCRLF()
+    {
+        if (ReadAbleSize() == 0)
+            return NULL;
+        return (char *)ByteScan::FindDoubleCRLF(ReadPosition(), ReadAbleSize());
+    }
+
     /*通常获取一行数据，这种情况针对是*/
     std::string GetLine()
     {
@@ -173,7 +266,57 @@ public:
         return str;
     }
 
-    // 清空缓冲区
+    /*从描述符中读取数据：readv直接读到缓冲区末尾的空闲空间，放不下的部分读到栈上的溢出区再追加，
+     * 能放下的数据不需要再复制一次，一次系统调用最多可以读取空闲空间加溢出区那么多，缓冲区也只按实际读到的大小增长
+     * len返回这次最多能读取的长度（读满了说明内核中可能还有数据）；返回值和readv一致*/
+    ssize_t ReadFromFd(int fd, uint64_t *len = NULL)
+    {
+        if (ReadAbleSize() == 0)
+        {
+            // 没有未读数据，偏移归0，整个缓冲区都可以用来接收
+            _reader_idx = 0;
+            _writer_idx = 0;
+        }
+        if (_buffer == NULL)
+            Reallocate(BUFFER_DEFAULT_SIZE);
+        char spill[BUFFER_SPILL_SIZE];
+        uint64_t idle = TailIdleSize();
+        struct iovec iov[2];
+        iov[0].iov_base = WritePosition();
+        iov[0].iov_len = idle;
+        iov[1].iov_base = spill;
+        iov[1].iov_len = sizeof(spill);
+        if (len)
+            *len = idle + sizeof(spill);
+        ssize_t ret = readv(fd, iov, 2);
+        if (ret <= 0)
+            return ret;
+        if ((uint64_t)ret <= idle)
+        {
+            MoveWriteOffset(ret);
+            return ret;
+        }
+        MoveWriteOffset(idle);
+        WriteAndPush(spill, ret - idle);
+        return ret;
+    }
+
+    // 释放多余的内存：没有可读数据就把内存块还给BufferPool，否则换成刚好能放下可读数据的块
+    void Shrink()
+    {
+        uint64_t rsz = ReadAbleSize();
+        if (rsz == 0)
+        {
+            Release();
+            _reader_idx = 0;
+            _writer_idx = 0;
+            return;
+        }
+        if (BufferPool::RoundUp(rsz) < _capacity)
+            Reallocate(rsz);
+    }
+
+    // 清空缓冲区（不释放内存，需要释放时再调用Shrink）
     void Clear()
     {
         // 只需要将偏移量归0即可
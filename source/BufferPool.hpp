@@ -0,0 +1,205 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define BUFFER_POOL_MIN_SHIFT 8            // 最小一档256字节
+#define BUFFER_POOL_MAX_SHIFT 24           // 最大一档16MB，更大的块直接向系统申请，用完直接归还
+#define BUFFER_POOL_CLASSES (BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1)
+#define BUFFER_POOL_CACHE_BYTES (4 << 20)  // 每档最多缓存4MB的空闲块，超过4MB的档不缓存
+#define BUFFER_HUGE_SHIFT 21               // 2MB及以上的块使用mmap分配，开启大页时由大页支撑
+#define BUFFER_HUGE_PAGE_SIZE (1UL << BUFFER_HUGE_SHIFT)
+/*缓冲区内存块池：每个线程一个，也就是每个EventLoop一个，不需要加锁。
+ * 块的大小都是2的幂，按大小分档，释放的块挂在对应档的空闲链表上，下一次同一档的申请直接复用，
+ * 连接的建立和销毁、Send中的临时缓冲区都不再经过malloc。
+ * 块的大小就是它的档位，释放时由调用者传回分配时得到的容量；在其他线程释放的块进入那个线程的池，分档一致，不影响复用。
+ * 2MB及以上的块用mmap分配，开启大页后优先使用预留的大页（MAP_HUGETLB），没有预留就对齐到2MB再建议内核使用透明大页。*/
+class BufferPool
+{
+private:
+    struct FreeBlock
+    {
+        FreeBlock *next;
+    };
+    FreeBlock *_free[BUFFER_POOL_CLASSES];
+    size_t _count[BUFFER_POOL_CLASSES];
+    size_t _low[BUFFER_POOL_CLASSES]; // 上一次Trim之后每档空闲块数的最低点，这么多块一直没有被用到
+
+private:
+    static std::atomic<bool> &HugePages()
+    {
+        static std::atomic<bool> enabled(false);
+        return enabled;
+    }
+    // 线程退出时池先于线程中其他对象析构，之后释放的块直接还给系统
+    static bool &Destroyed()
+    {
+        static thread_local bool destroyed = false;
+        return destroyed;
+    }
+    static int ClassOf(uint64_t capacity) { return __builtin_ctzll(capacity) - BUFFER_POOL_MIN_SHIFT; }
+    static size_t CacheLimit(int cls) { return BUFFER_POOL_CACHE_BYTES >> (cls + BUFFER_POOL_MIN_SHIFT); }
+    static char *MapHuge(uint64_t capacity)
+    {
+        void *ptr = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED)
+            return (char *)ptr;
+        // 没有预留大页：多映射2MB，把首尾多余的部分还回去，剩下的起始地址按2MB对齐，透明大页才能生效
+        uint64_t len = capacity + BUFFER_HUGE_PAGE_SIZE;
+        ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+            return NULL;
+        uintptr_t start = (uintptr_t)ptr;
+        uintptr_t aligned = (start + BUFFER_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(BUFFER_HUGE_PAGE_SIZE - 1);
+        if (aligned > start)
+            munmap(ptr, aligned - start);
+        if (aligned + capacity < start + len)
+            munmap((void *)(aligned + capacity), start + len - aligned - capacity);
+        madvise((void *)aligned, capacity, MADV_HUGEPAGE);
+        return (char *)aligned;
+    }
+
+public:
+    BufferPool()
+    {
+        for (int i = 0; i < BUFFER_POOL_CLASSES; i++)
+        {
+            _free[i] = NULL;
+            _count[i] = 0;
+            _low[i] = 0;
+        }
+    }
+    ~BufferPool()
+    {
+        for (int i = 0; i < BUFFER_POOL_CLASSES; i++)
+        {
+            while (_free[i])
+            {
+                FreeBlock *block = _free[i];
+                _free[i] = block->next;
+                SystemFree((char *)block, (uint64_t)1 << (i + BUFFER_POOL_MIN_SHIFT));
+            }
+            _count[i] = 0;
+        }
+        Destroyed() = true;
+    }
+    // 当前线程的池，线程正在退出（池已经析构）时返回NULL
+    static BufferPool *Local()
+    {
+        if (Destroyed())
+            return NULL;
+        static thread_local BufferPool pool;
+        return &pool;
+    }
+    // 2MB及以上的块使用大页，任意线程都可以调用，只影响之后新分配的块
+    static void EnableHugePages(bool on = true) { HugePages().store(on, std::memory_order_relaxed); }
+    // 能容纳size字节的块大小：不小于256的2的幂
+    static uint64_t RoundUp(uint64_t size)
+    {
+        if (size <= ((uint64_t)1 << BUFFER_POOL_MIN_SHIFT))
+            return (uint64_t)1 << BUFFER_POOL_MIN_SHIFT;
+        return (uint64_t)1 << (64 - __builtin_clzll(size - 1));
+    }
+    // 直接向系统申请/归还，capacity必须是RoundUp得到的大小
+    static char *SystemAlloc(uint64_t capacity)
+    {
+        if (capacity < BUFFER_HUGE_PAGE_SIZE)
+        {
+            char *ptr = (char *)malloc(capacity);
+            if (ptr == NULL)
+                throw std::bad_alloc();
+            return ptr;
+        }
+        char *ptr = NULL;
+        if (HugePages().load(std::memory_order_relaxed))
+            ptr = MapHuge(capacity);
+        else
+        {
+            void *p = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            ptr = p == MAP_FAILED ? NULL : (char *)p;
+        }
+        if (ptr == NULL)
+            throw std::bad_alloc();
+        return ptr;
+    }
+    static void SystemFree(char *block, uint64_t capacity)
+    {
+        if (capacity < BUFFER_HUGE_PAGE_SIZE)
+            return free(block);
+        munmap(block, capacity);
+    }
+    // 分配至少size字节的块，capacity返回块的实际大小，释放时原样传回
+    char *Alloc(uint64_t size, uint64_t *capacity)
+    {
+        *capacity = RoundUp(size);
+        if (*capacity > ((uint64_t)1 << BUFFER_POOL_MAX_SHIFT))
+            return SystemAlloc(*capacity);
+        int cls = ClassOf(*capacity);
+        FreeBlock *block = _free[cls];
+        if (block == NULL)
+            return SystemAlloc(*capacity);
+        _free[cls] = block->next;
+        _count[cls]--;
+        if (_count[cls] < _low[cls])
+            _low[cls] = _count[cls];
+        return (char *)block;
+    }
+    void Free(char *block, uint64_t capacity)
+    {
+        if (capacity > ((uint64_t)1 << BUFFER_POOL_MAX_SHIFT))
+            return SystemFree(block, capacity);
+        int cls = ClassOf(capacity);
+        if (_count[cls] >= CacheLimit(cls))
+            return SystemFree(block, capacity);
+        FreeBlock *node = (FreeBlock *)block;
+        node->next = _free[cls];
+        _free[cls] = node;
+        _count[cls]++;
+    }
+    // 把上一次Trim以来一直没有被用到的空闲块还给系统，返回释放的字节数；由EventLoop的定时任务周期调用
+    uint64_t Trim()
+    {
+        uint64_t released = 0;
+        for (int i = 0; i < BUFFER_POOL_CLASSES; i++)
+        {
+            uint64_t capacity = (uint64_t)1 << (i + BUFFER_POOL_MIN_SHIFT);
+            for (; _low[i] > 0; _low[i]--)
+            {
+                FreeBlock *block = _free[i];
+                _free[i] = block->next;
+                _count[i]--;
+                SystemFree((char *)block, capacity);
+                released += capacity;
+            }
+            _low[i] = _count[i];
+        }
+        return released;
+    }
+    // 池中缓存的空闲块总大小
+    uint64_t CachedBytes()
+    {
+        uint64_t total = 0;
+        for (int i = 0; i < BUFFER_POOL_CLASSES; i++)
+            total += (uint64_t)_count[i] << (i + BUFFER_POOL_MIN_SHIFT);
+        return total;
+    }
+    // 从当前线程的池中分配/释放，线程正在退出时直接使用系统的
+    static char *LocalAlloc(uint64_t size, uint64_t *capacity)
+    {
+        BufferPool *pool = Local();
+        if (pool)
+            return pool->Alloc(size, capacity);
+        *capacity = RoundUp(size);
+        return SystemAlloc(*capacity);
+    }
+    static void LocalFree(char *block, uint64_t capacity)
+    {
+        BufferPool *pool = Local();
+        if (pool)
+            return pool->Free(block, capacity);
+        SystemFree(block, capacity);
+    }
+};
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define BYTESCAN_X86 1
+#endif
+
+#define BYTESCAN_MAX_DELIMS 4 // FindAny一次最多查找的分隔符个数
+/*向量化的字节查找：x86_64上每次比较16字节（SSE2）或32字节（AVX2，运行时检测CPU支持才使用），其他平台逐字节查找
+ * FindDoubleCRLF：查找"\r\n\r\n"，用来定位HTTP头部的结尾
+ * FindAny：一遍扫描找出多个分隔符的所有位置，比如同时找出头部每一行的':'和'\n'，不需要每行调用一次memchr*/
+class ByteScan
+{
+public:
+    // 各个实现也是公开的，测试程序用来逐一对比SIMD版本和逐字节版本的结果；平时直接调用下面的FindDoubleCRLF/FindAny
+    static const char *FindDoubleCRLFScalar(const char *data, size_t len, size_t i)
+    {
+        for (; i + 4 <= len; i++)
+        {
+            if (data[i] == '\r' && data[i + 1] == '\n' && data[i + 2] == '\r' && data[i + 3] == '\n')
+                return data + i;
+        }
+        return NULL;
+    }
+    static size_t FindAnyScalar(const char *data, size_t len, size_t i, const char *delims, int ndelims,
+                                size_t *offsets, size_t count, size_t max)
+    {
+        for (; i < len && count < max; i++)
+        {
+            for (int k = 0; k < ndelims; k++)
+            {
+                if (data[i] == delims[k])
+                {
+                    offsets[count++] = i;
+                    break;
+                }
+            }
+        }
+        return count;
+    }
+#ifdef BYTESCAN_X86
+    static bool HasAvx2()
+    {
+        static const bool has = []()
+        {
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") != 0;
+        }();
+        return has;
+    }
+    // 每次比较16个起始位置：分别从i、i+1、i+2、i+3加载，4个比较结果相与，某一位为1说明从那里开始是"\r\n\r\n"
+    static const char *FindDoubleCRLFSse2(const char *data, size_t len)
+    {
+        const __m128i cr = _mm_set1_epi8('\r');
+        const __m128i lf = _mm_set1_epi8('\n');
+        size_t i = 0;
+        for (; i + 16 + 3 <= len; i += 16)
+        {
+            __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), cr);
+            __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 1)), lf);
+            __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 2)), cr);
+            __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 3)), lf);
+            int mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), _mm_and_si128(c, d)));
+            if (mask)
+                return data + i + __builtin_ctz(mask);
+        }
+        return FindDoubleCRLFScalar(data, len, i);
+    }
+    __attribute__((target("avx2"))) static const char *FindDoubleCRLFAvx2(const char *data, size_t len)
+    {
+        const __m256i cr = _mm256_set1_epi8('\r');
+        const __m256i lf = _mm256_set1_epi8('\n');
+        size_t i = 0;
+        for (; i + 32 + 3 <= len; i += 32)
+        {
+            __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), cr);
+            __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 1)), lf);
+            __m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 2)), cr);
+            __m256i d = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 3)), lf);
+            uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, d)));
+            if (mask)
+                return data + i + __builtin_ctz(mask);
+        }
+        return FindDoubleCRLFScalar(data, len, i);
+    }
+    // 不足BYTESCAN_MAX_DELIMS个分隔符时用第一个补齐，比较结果相或，每个为1的位就是一个分隔符
+    static size_t FindAnySse2(const char *data, size_t len, const char *delims, int ndelims, size_t *offsets, size_t max)
+    {
+        __m128i d[BYTESCAN_MAX_DELIMS];
+        for (int k = 0; k < BYTESCAN_MAX_DELIMS; k++)
+            d[k] = _mm_set1_epi8(delims[k < ndelims ? k : 0]);
+        size_t i = 0, count = 0;
+        for (; i + 16 <= len; i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+            __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, d[0]), _mm_cmpeq_epi8(v, d[1])),
+                                     _mm_or_si128(_mm_cmpeq_epi8(v, d[2]), _mm_cmpeq_epi8(v, d[3])));
+            uint32_t mask = (uint32_t)_mm_movemask_epi8(m);
+            while (mask)
+            {
+                if (count == max)
+                    return count;
+                offsets[count++] = i + __builtin_ctz(mask);
+                mask &= mask - 1;
+            }
+        }
+        return FindAnyScalar(data, len, i, delims, ndelims, offsets, count, max);
+    }
+    __attribute__((target("avx2"))) static size_t FindAnyAvx2(const char *data, size_t len, const char *delims, int ndelims,
+                                                              size_t *offsets, size_t max)
+    {
+        __m256i d[BYTESCAN_MAX_DELIMS];
+        for (int k = 0; k < BYTESCAN_MAX_DELIMS; k++)
+            d[k] = _mm256_set1_epi8(delims[k < ndelims ? k : 0]);
+        size_t i = 0, count = 0;
+        for (; i + 32 <= len; i += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+            __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, d[0]), _mm256_cmpeq_epi8(v, d[1])),
+                                        _mm256_or_si256(_mm256_cmpeq_epi8(v, d[2]), _mm256_cmpeq_epi8(v, d[3])));
+            uint32_t mask = (uint32_t)_mm256_movemask_epi8(m);
+            while (mask)
+            {
+                if (count == max)
+                    return count;
+                offsets[count++] = i + __builtin_ctz(mask);
+                mask &= mask - 1;
+            }
+        }
+        return FindAnyScalar(data, len, i, delims, ndelims, offsets, count, max);
+    }
+#endif
+
+    // 查找第一个"\r\n\r\n"，返回它的起始位置，没找到返回NULL
+    static const char *FindDoubleCRLF(const char *data, size_t len)
+    {
+#ifdef BYTESCAN_X86
+        if (HasAvx2())
+            return FindDoubleCRLFAvx2(data, len);
+        return FindDoubleCRLFSse2(data, len);
+#else
+        return FindDoubleCRLFScalar(data, len, 0);
+#endif
+    }
+    // 按顺序找出delims中任意一个字符（最多BYTESCAN_MAX_DELIMS个）出现的位置，最多max个，返回找到的个数；
+    // 返回max说明后面可能还有，从最后一个位置之后继续查找
+    static size_t FindAny(const char *data, size_t len, const char *delims, int ndelims, size_t *offsets, size_t max)
+    {
+        assert(ndelims > 0 && ndelims <= BYTESCAN_MAX_DELIMS);
+#ifdef BYTESCAN_X86
+        if (HasAvx2())
+            return FindAnyAvx2(data, len, delims, ndelims, offsets, max);
+        return FindAnySse2(data, len, delims, ndelims, offsets, max);
+#else
+        return FindAnyScalar(data, len, 0, delims, ndelims, offsets, 0, max);
+#endif
+    }
+};
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <sys/uio.h>
+
+#include "Buffer.hpp"
+
+#define CHAIN_BLOCK_SIZE 16384                  // 每个块（包括块头）的大小，正好是BufferPool的一档
+#define CHAIN_BLOCK_DATA (CHAIN_BLOCK_SIZE - 16) // 每个块的数据区大小
+/*块链缓冲区：由固定大小的块组成的单向链表，写入追加到最后一个块，写满了就在尾部接一个新块；
+ * 读取从第一个块开始，读完的块直接释放。已经写入的数据从来不会被移动或者复制到新内存，
+ * 不管积压了多少数据，写入和读取的代价都只和本次的数据量有关，适合作为发送缓冲区（对端读得慢时可能积压很多）。
+ * 接口和Buffer基本一致，只是数据不连续：没有ReadPosition，需要连续访问时用Read复制出来，
+ * FindCRLF返回的是相对于可读数据起始位置的偏移（没找到为-1）而不是指针，发送时用Iovec一次取出多个块交给writev/sendmsg。*/
+class ChainBuffer
+{
+private:
+    struct Block
+    {
+        Block *next;
+        uint32_t read;  // 块内读偏移
+        uint32_t write; // 块内写偏移
+        char data[CHAIN_BLOCK_DATA];
+    };
+    Block *_head;   // 第一个有数据的块
+    Block *_tail;   // 最后一个块，写入的位置
+    uint64_t _size; // 可读数据大小
+
+private:
+    static Block *NewBlock()
+    {
+        static_assert(sizeof(Block) == CHAIN_BLOCK_SIZE, "block header must be 16 bytes");
+        uint64_t capacity = 0;
+        Block *block = (Block *)BufferPool::LocalAlloc(CHAIN_BLOCK_SIZE, &capacity);
+        block->next = NULL;
+        block->read = 0;
+        block->write = 0;
+        return block;
+    }
+    static void FreeBlock(Block *block) { BufferPool::LocalFree((char *)block, CHAIN_BLOCK_SIZE); }
+    // 从第一个块开始，对前len字节的每一段连续数据调用func(const char *, size_t)，func返回false就停止
+    template <typename Func>
+    void ForEach(uint64_t len, Func func)
+    {
+        for (Block *block = _head; block != NULL && len > 0; block = block->next)
+        {
+            uint64_t n = block->write - block->read;
+            n = n < len ? n : len;
+            if (func(block->data + block->read, n) == false)
+                return;
+            len -= n;
+        }
+    }
+
+    // 所有块还给BufferPool
+    void Release()
+    {
+        while (_head)
+        {
+            Block *block = _head;
+            _head = block->next;
+            FreeBlock(block);
+        }
+        _tail = NULL;
+        _size = 0;
+    }
+
+public:
+    ChainBuffer() : _head(NULL), _tail(NULL), _size(0) {}
+    // 块由缓冲区独占，不能复制（复制出来的两个对象会重复释放同样的块），只能移动
+    ChainBuffer(const ChainBuffer &) = delete;
+    ChainBuffer &operator=(const ChainBuffer &) = delete;
+    ChainBuffer(ChainBuffer &&other) : _head(other._head), _tail(other._tail), _size(other._size)
+    {
+        other._head = other._tail = NULL;
+        other._size = 0;
+    }
+    ChainBuffer &operator=(ChainBuffer &&other)
+    {
+        if (this != &other)
+        {
+            Release();
+            _head = other._head;
+            _tail = other._tail;
+            _size = other._size;
+            other._head = other._tail = NULL;
+            other._size = 0;
+        }
+        return *this;
+    }
+    ~ChainBuffer() { Release(); }
+    // 获取可读数据大小
+    uint64_t ReadAbleSize() { return _size; }
+
+    // 将读偏移向后移动，读完的块直接释放；最后一个块保留下来继续写入
+    void MoveReadOffset(uint64_t len)
+    {
+        assert(len <= ReadAbleSize());
+        _size -= len;
+        while (len > 0)
+        {
+            uint64_t n = _head->write - _head->read;
+            if (len < n)
+            {
+                _head->read += len;
+                return;
+            }
+            len -= n;
+            if (_head == _tail)
+            {
+                _head->read = _head->write = 0;
+                return;
+            }
+            Block *block = _head;
+            _head = block->next;
+            FreeBlock(block);
+        }
+        if (_size == 0 && _head)
+            _head->read = _head->write = 0;
+    }
+
+    // 写入数据并移动写偏移（块链没有预留空间再提交的写法，写入就是追加）
+    void WriteAndPush(const void *data, uint64_t len)
+    {
+        const char *d = (const char *)data;
+        while (len > 0)
+        {
+            if (_tail == NULL)
+                _head = _tail = NewBlock();
+            else if (_tail->write == CHAIN_BLOCK_DATA)
+                _tail = _tail->next = NewBlock();
+            uint64_t n = CHAIN_BLOCK_DATA - _tail->write;
+            n = n < len ? n : len;
+            memcpy(_tail->data + _tail->write, d, n);
+            _tail->write += n;
+            _size += n;
+            d += n;
+            len -= n;
+        }
+    }
+
+    void WriteStringAndPush(const std::string &data)
+    {
+        WriteAndPush(data.c_str(), data.size());
+    }
+
+    void WriteBufferAndPush(Buffer &data)
+    {
+        WriteAndPush(data.ReadPosition(), data.ReadAbleSize());
+    }
+
+    // 读取数据（不移动读偏移）
+    void Read(void *buf, uint64_t len)
+    {
+        assert(len <= ReadAbleSize());
+        char *out = (char *)buf;
+        ForEach(len, [&out](const char *data, size_t n) -> bool
+                {
+                    memcpy(out, data, n);
+                    out += n;
+                    return true; });
+    }
+
+    void ReadAndPop(void *buf, uint64_t len)
+    {
+        Read(buf, len);
+        MoveReadOffset(len);
+    }
+
+    std::string ReadAsString(uint64_t len)
+    {
+        assert(len <= ReadAbleSize());
+        std::string str;
+        str.resize(len);
+        Read(&str[0], len);
+        return str;
+    }
+
+    std::string ReadAsStringAndPop(uint64_t len)
+    {
+        std::string str = ReadAsString(len);
+        MoveReadOffset(len);
+        return str;
+    }
+
+    // 查找第一个换行符，返回它相对于可读数据起始位置的偏移，没找到返回-1
+    int64_t FindCRLF()
+    {
+        int64_t offset = 0, found = -1;
+        ForEach(_size, [&offset, &found](const char *data, size_t n) -> bool
+                {
+                    const char *pos = (const char *)memchr(data, '\n', n);
+                    if (pos != NULL)
+                    {
+                        found = offset + (pos - data);
+                        return false;
+                    }
+                    offset += n;
+                    return true; });
+        return found;
+    }
+
+    std::string GetLine()
+    {
+        int64_t pos = FindCRLF();
+        if (pos < 0)
+        {
+            return "";
+        }
+        // +1是为了把换行字符也取出来。
+        return ReadAsString(pos + 1);
+    }
+
+    std::string GetLineAndPop()
+    {
+        std::string str = GetLine();
+        MoveReadOffset(str.size());
+        return str;
+    }
+
+    // 把前面最多max段连续数据填入iov，返回填入的段数，用于writev/sendmsg
+    int Iovec(struct iovec *iov, int max)
+    {
+        int count = 0;
+        ForEach(_size, [iov, max, &count](const char *data, size_t n) -> bool
+                {
+                    iov[count].iov_base = (void *)data;
+                    iov[count].iov_len = n;
+                    return ++count < max; });
+        return count;
+    }
+
+    // 没有可读数据时把保留的块也释放掉（有数据时每个块都装着数据，没有多余的内存）
+    void Shrink()
+    {
+        if (_size > 0 || _head == NULL)
+            return;
+        FreeBlock(_head);
+        _head = _tail = NULL;
+    }
+
+    // 清空缓冲区，只保留一个块继续使用
+    void Clear()
+    {
+        if (_head == NULL)
+            return;
+        MoveReadOffset(_size);
+    }
+};
@@ -2,6 +2,7 @@
 
 #include "Any.hpp"
 #include "Buffer.hpp"
+#include "ChainBuffer.hpp"
 #include "EventLoop.hpp"
 #include "Socket.hpp"
 
@@ -17,9 +18,24 @@ typedef enum
 
 using PtrConnection = std::shared_ptr<Connection>;
 
+#define CONN_IOV_MAX 64 // 一次发送最多取出的块数（64个16KB的块，1MB）
+
+// 在连接上等待的协程（见Coroutine.hpp）：有新数据、发送完毕或者连接关闭时由Connection调用wake，不经过std::function
+struct ConnWaiter
+{
+    void (*wake)(ConnWaiter *waiter);
+};
+class ConnAwaiter;
+class ConnReadAwaiter;
+class ConnReadUntilAwaiter;
+class ConnWriteAwaiter;
+
 class Connection : public std::enable_shared_from_this<Connection>
 {
 private:
+    friend class Channel;     // Channel通过SetHandler直接调用下面的事件处理函数
+    friend class ConnAwaiter; // 协程的等待操作直接访问缓冲区和等待者
+
     // uint64_t _timer_id;            // 定时器ID，必须是唯一的，这块为了简化操作使用conn_id作为定时器ID
 
     uint64_t _conn_id;             // 连接的唯一ID，便于连接的管理和查找
@@ -28,15 +44,35 @@ private:
 
     ConnStatu _statu; // 连接状态
 
+    /*一次事件的处理预算：避免一个连接（比如流水线请求很多的客户端）长时间占用EventLoop，其他连接都在等待
+     * 超出预算剩下的工作投递到任务池，等本轮其他连接的事件都处理完之后再继续，0表示不限制*/
+    size_t _read_budget;     // 边沿触发时一次事件最多读取的字节数
+    uint32_t _message_budget; // 一次消息回调最多处理的消息数
+    uint32_t _messages;       // 本次消息回调已经处理的消息数
+    bool _resume_pending;     // 是否已经投递了继续处理消息的任务
+
     Socket _socket;   // 套接字操作管理
     Channel _channel; // 连接的事件管理
     EventLoop *_loop; // 连接所关联的一个EventLoop
 
-    Buffer _in_buffer;  // 输入缓冲区---存放从socket中读取到的数据
-    Buffer _out_buffer; // 输出缓冲区---存放要发送给对端的数据
+    Buffer _in_buffer;       // 输入缓冲区---存放从socket中读取到的数据
+    ChainBuffer _out_buffer; // 输出缓冲区---存放要发送给对端的数据，对端读得慢时积压再多也不会移动数据
 
     Any _context; // 请求的接收处理上下文
 
+    /*缓冲区收缩：大请求体会把输入缓冲区撑大，长连接上这块内存不归还就一直被占着
+     * 处理完数据后输入缓冲区空了并且超过阈值，立即把内存块还给BufferPool；
+     * 连接空闲超过一段时间，把两个缓冲区多余的内存都还回去。空闲的判断只在定时任务到期时比较事件计数，不给每次事件增加开销*/
+    uint64_t _shrink_threshold; // 输入缓冲区处理完之后还保留的最大容量，0表示不立即收缩
+    uint32_t _shrink_idle_ms;   // 空闲多久收缩缓冲区，0表示不开启
+    uint64_t _activity;         // 事件计数
+    uint64_t _shrink_seen;      // 收缩定时任务添加时的事件计数
+    bool _shrink_armed;         // 是否已经添加了收缩定时任务
+    TimerHandle _shrink_timer;
+
+    ConnWaiter *_read_waiter;  // 等待输入数据的协程，设置了就不再调用消息回调
+    ConnWaiter *_write_waiter; // 等待发送缓冲区发送完毕的协程
+
     /*这四个回调函数，是让服务器模块来设置的（其实服务器模块的处理回调也是组件使用者设置的）*/
     /*换句话说，这几个回调都是组件使用者使用的*/
     using ConnectedCallback = std::function<void(const PtrConnection &)>;
@@ -58,41 +94,146 @@ private:
     void HandleRead()
     {
         // 1. 接收socket的数据，放到缓冲区
-        char buf[65536];
-        ssize_t ret = _socket.NonBlockRecv(buf, 65535);
-        if (ret < 0)
+        //    水平触发每次只读一次；边沿触发要一直读到EAGAIN，否则剩下的数据不会再通知
+        //    数据直接读到输入缓冲区中，放不下的才经过栈上的溢出区
+        size_t total = 0;
+        while (1)
         {
-            // 出错了,不能直接关闭连接
-            return ShutdownInLoop();
+            uint64_t len = 0;
+            ssize_t ret = _in_buffer.ReadFromFd(_sockfd, &len);
+            if (ret == 0)
+            {
+                // 对端关闭了连接，不能直接释放，还要处理已经收到的数据
+                return ShutdownInLoop();
+            }
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                    continue; // 被信号打断，数据还在内核缓冲区中，边沿触发不会再通知，重新读
+                if (errno != EAGAIN)
+                {
+                    ERR_LOG("SOCKET RECV FAILED!!");
+                    return ShutdownInLoop(); // 出错了,不能直接关闭连接
+                }
+                break; // 内核缓冲区已经读空了
+            }
+            // 没读满说明内核缓冲区已经读空了，不用再多一次readv去确认EAGAIN；
+            // 但是对端已经关闭（EPOLLRDHUP）时还有一个EOF要读，边沿触发不会再通知，必须读到返回0为止
+            if (_channel.EdgeTrigger() == false)
+                break;
+            if ((uint64_t)ret < len && (_channel.REvents() & EPOLLRDHUP) == 0)
+                break;
+            total += ret;
+            if (_read_budget > 0 && total >= _read_budget)
+            {
+                // 预算用完了，边沿触发不会再通知，投递一个任务稍后接着读
+                _loop->QueueInLoop(std::bind(&Connection::ResumeRead, shared_from_this()));
+                break;
+            }
         }
-        // 这里的等于0表示的是没有读取到数据，而并不是连接断开了，连接断开返回的是-1
-        // 将数据放入输入缓冲区,写入之后顺便将写偏移向后移动
-        _in_buffer.WriteAndPush(buf, ret);
         // 2. 调用message_callback进行业务处理
         if (_in_buffer.ReadAbleSize() > 0)
         {
-            // shared_from_this--从当前对象自身获取自身的shared_ptr管理对象
-            return _message_callback(shared_from_this(), &_in_buffer);
+            DeliverMessage();
+            ShrinkDrained();
+        }
+    }
+    void ResumeRead()
+    {
+        if (_statu != CONNECTED)
+            return; // 连接已经关闭了，描述符可能已经被其他连接复用
+        HandleRead();
+    }
+    // 把输入缓冲区交给等待数据的协程或者消息回调，重新开始计算消息预算
+    void DeliverMessage()
+    {
+        if (_read_waiter)
+            return Wake(_read_waiter);
+        _messages = 0;
+        // shared_from_this--从当前对象自身获取自身的shared_ptr管理对象
+        if (_message_callback)
+            _message_callback(shared_from_this(), &_in_buffer);
+    }
+    // 先清空再唤醒，协程恢复后可以立即重新等待
+    void Wake(ConnWaiter *&slot)
+    {
+        ConnWaiter *waiter = slot;
+        slot = NULL;
+        waiter->wake(waiter);
+    }
+    void ResumeMessage()
+    {
+        _resume_pending = false;
+        if (_statu != CONNECTED || _in_buffer.ReadAbleSize() == 0)
+            return;
+        DeliverMessage();
+    }
+    // io_uring后端：数据已经由内核收到提供的缓冲区中，只需要放入输入缓冲区
+    void HandleRecv(const char *data, ssize_t len)
+    {
+        if (len <= 0)
+        {
+            // 对端关闭或者出错了，和HandleRead中recv失败的处理一致
+            return ShutdownInLoop();
+        }
+        _in_buffer.WriteAndPush(data, len);
+        if (_in_buffer.ReadAbleSize() > 0)
+        {
+            DeliverMessage();
+            ShrinkDrained();
         }
     }
+    // 输入缓冲区的数据都处理完了，容量超过阈值就把内存块还给BufferPool，下次收到数据再按需分配
+    void ShrinkDrained()
+    {
+        if (_shrink_threshold > 0 && _in_buffer.ReadAbleSize() == 0 && _in_buffer.Capacity() > _shrink_threshold)
+            _in_buffer.Shrink();
+    }
+    // 添加收缩定时任务，记下当前的事件计数，到期时计数没有变化说明这段时间连接一直空闲
+    void ArmShrink()
+    {
+        _shrink_armed = true;
+        _shrink_seen = _activity;
+        _shrink_timer = _loop->RunAfter(_shrink_idle_ms, [this]()
+                                        { OnShrinkTimer(); });
+    }
+    void OnShrinkTimer()
+    {
+        _shrink_armed = false;
+        if (_statu == DISCONNECTED)
+            return;
+        if (_activity != _shrink_seen)
+            return ArmShrink(); // 这段时间有过事件，从现在重新计时
+        // 空闲了：释放多余的内存，直到下一次有事件才重新添加定时任务
+        _in_buffer.Shrink();
+        _out_buffer.Shrink();
+    }
     // 描述符可写事件触发后调用的函数，将发送缓冲区中的数据进行发送
     void HandleWrite()
     {
-        //_out_buffer中保存的数据就是要发送的数据
-        ssize_t ret = _socket.NonBlockSend(_out_buffer.ReadPosition(), _out_buffer.ReadAbleSize());
-        if (ret < 0)
+        //_out_buffer中保存的数据就是要发送的数据，边沿触发时一直发送到EAGAIN或者数据发完为止
+        while (_out_buffer.ReadAbleSize() > 0)
         {
-            // 发送错误就该关闭连接了，
-            if (_in_buffer.ReadAbleSize() > 0)
+            size_t len = 0;
+            ssize_t ret = FlushOutBuffer(&len);
+            if (ret < 0)
             {
-                _message_callback(shared_from_this(), &_in_buffer);
+                // 发送错误就该关闭连接了，
+                if (_in_buffer.ReadAbleSize() > 0)
+                {
+                    DeliverMessage();
+                }
+                return Release(); // 这时候就是实际的关闭释放操作了。
             }
-            return Release(); // 这时候就是实际的关闭释放操作了。
+            // 没发完说明内核发送缓冲区已满，等下一次可写事件
+            if (_channel.EdgeTrigger() == false || (size_t)ret < len)
+                break;
         }
-        _out_buffer.MoveReadOffset(ret); // 千万不要忘了，将读偏移向后移动
         if (_out_buffer.ReadAbleSize() == 0)
         {
             _channel.DisableWrite(); // 没有数据待发送了，关闭写事件监控
+            if (_write_waiter)
+                Wake(_write_waiter);
             // 如果当前是连接待关闭状态，则有数据，发送完数据释放连接，没有数据则直接释放
             if (_statu == DISCONNECTING)
             {
@@ -107,7 +248,7 @@ private:
         /*一旦连接挂断了，套接字就什么都干不了了，因此有数据待处理就处理一下，完毕关闭连接*/
         if (_in_buffer.ReadAbleSize() > 0)
         {
-            _message_callback(shared_from_this(), &_in_buffer);
+            DeliverMessage();
         }
         return Release();
     }
@@ -119,6 +260,9 @@ private:
     // 描述符触发任意事件: 1. 刷新连接的活跃度--延迟定时销毁任务；  2. 调用组件使用者的任意事件回调
     void HandleEvent()
     {
+        _activity++;
+        if (_shrink_idle_ms > 0 && _shrink_armed == false && _statu != DISCONNECTED)
+            ArmShrink();
         if (_enable_inactive_release == true)
         {
             _loop->TimerRefresh(_conn_id);
@@ -140,19 +284,51 @@ private:
             _connected_callback(shared_from_this());
     }
     // 这个接口并不是实际的发送接口，而只是把数据放到了发送缓冲区，启动了可写事件监控
-    void SendInLoop(Buffer &buf)
+    void SendBufferInLoop(Buffer &buf)
+    {
+        SendInLoop(buf.ReadPosition(), buf.ReadAbleSize());
+    }
+    void SendInLoop(const char *data, size_t len)
     {
         if (_statu == DISCONNECTED)
             return;
-        _out_buffer.WriteBufferAndPush(buf);
-        if (_channel.WriteAble() == false)
+        if (_channel.WriteAble() == false && _out_buffer.ReadAbleSize() == 0)
         {
-            _channel.EnableWrite();
+            // 没有在等待可写事件，之前的数据也都发完了，先直接从调用者的内存发送一次，
+            // 大多数响应一次就能发完，既不用复制到发送缓冲区，也省去启动、关闭写事件监控的两次epoll_ctl；
+            // 发不完的部分才放入发送缓冲区（出错时也放入），交给HandleWrite
+            ssize_t ret = _socket.NonBlockSend(data, len);
+            if (ret > 0)
+            {
+                data += ret;
+                len -= ret;
+            }
+            if (len == 0)
+                return;
         }
+        _out_buffer.WriteAndPush(data, len);
+        if (_channel.WriteAble() == false)
+            _channel.EnableWrite();
+    }
+    // 把发送缓冲区中的多个块一次发送出去，len返回这次尝试发送的长度，返回值和Socket::NonBlockSend一致
+    ssize_t FlushOutBuffer(size_t *len)
+    {
+        struct iovec iov[CONN_IOV_MAX];
+        int count = _out_buffer.Iovec(iov, CONN_IOV_MAX);
+        *len = 0;
+        for (int i = 0; i < count; i++)
+            *len += iov[i].iov_len;
+        ssize_t ret = _socket.NonBlockSendv(iov, count);
+        if (ret > 0)
+            _out_buffer.MoveReadOffset(ret); // 千万不要忘了，将读偏移向后移动
+        return ret;
     }
     // 这个接口才是实际的释放接口
     void ReleaseInLoop()
     {
+        // 关闭流程可能从多处触发（对端关闭、发送完毕、超时），释放任务可能被投递多次，只处理第一次
+        if (_statu == DISCONNECTED)
+            return;
         // 1. 修改连接状态，将其置为DISCONNECTED
         _statu = DISCONNECTED;
         // 2. 移除连接的事件监控
@@ -162,7 +338,14 @@ private:
         // 4. 如果当前定时器队列中还有定时销毁任务，则取消任务
         if (_loop->HasTimer(_conn_id))
             CancelInactiveReleaseInLoop();
-        // 5. 调用关闭回调函数，避免先移除服务器管理的连接信息导致Connection被释放，再去处理会出错，因此先调用用户的回调函数
+        if (_shrink_armed)
+            _loop->Cancel(_shrink_timer);
+        // 5. 唤醒还在等待的协程，它们会看到连接已经关闭
+        if (_read_waiter)
+            Wake(_read_waiter);
+        if (_write_waiter)
+            Wake(_write_waiter);
+        // 6. 调用关闭回调函数，避免先移除服务器管理的连接信息导致Connection被释放，再去处理会出错，因此先调用用户的回调函数
         if (_closed_callback)
             _closed_callback(shared_from_this());
         // 移除服务器内部管理的连接信息
@@ -176,8 +359,7 @@ private:
         _statu = DISCONNECTING; // 设置连接为半关闭状态
         if (_in_buffer.ReadAbleSize() > 0)
         {
-            if (_message_callback)
-                _message_callback(shared_from_this(), &_in_buffer);
+            DeliverMessage();
         }
         // 要么就是写入数据的时候出错关闭，要么就是没有待发送数据，直接关闭
         if (_out_buffer.ReadAbleSize() > 0)
@@ -203,7 +385,8 @@ private:
             return _loop->TimerRefresh(_conn_id);
         }
         // 3. 如果不存在定时销毁任务，则新增
-        _loop->TimerAdd(_conn_id, sec, std::bind(&Connection::Release, this));
+        _loop->TimerAdd(_conn_id, sec, [this]()
+                        { Release(); });
     }
     void CancelInactiveReleaseInLoop()
     {
@@ -232,20 +415,31 @@ public:
                                                                 _enable_inactive_release(false),
                                                                 _loop(loop),
                                                                 _statu(CONNECTING),
+                                                                _read_budget(0),
+                                                                _message_budget(0),
+                                                                _messages(0),
+                                                                _resume_pending(false),
                                                                 _socket(_sockfd),
-                                                                _channel(loop, _sockfd)
+                                                                _channel(loop, _sockfd),
+                                                                _shrink_threshold(0),
+                                                                _shrink_idle_ms(0),
+                                                                _activity(0),
+                                                                _shrink_seen(0),
+                                                                _shrink_armed(false),
+                                                                _read_waiter(NULL),
+                                                                _write_waiter(NULL)
     {
-        _channel.SetCloseCallback(std::bind(&Connection::HandleClose, this));
-        _channel.SetEventCallback(std::bind(&Connection::HandleEvent, this));
-        _channel.SetReadCallback(std::bind(&Connection::HandleRead, this));
-        _channel.SetWriteCallback(std::bind(&Connection::HandleWrite, this));
-        _channel.SetErrorCallback(std::bind(&Connection::HandleError, this));
+        // 直接分发到HandleRead/HandleWrite/HandleError/HandleClose/HandleEvent/HandleRecv，每个连接省去6个std::function
+        _channel.SetHandler(this);
+        _channel.SetTag(_conn_id);
     }
     ~Connection() { DBG_LOG("RELEASE CONNECTION:%p", this); }
     // 获取管理的文件描述符
     int Fd() { return _sockfd; }
     // 获取连接ID
     int Id() { return _conn_id; }
+    // 获取连接所属的EventLoop
+    EventLoop *GetLoop() { return _loop; }
     // 是否处于CONNECTED状态
     bool Connected() { return (_statu == CONNECTED); }
     // 设置上下文--连接建立完成时进行调用
@@ -257,38 +451,87 @@ public:
     void SetClosedCallback(const ClosedCallback &cb) { _closed_callback = cb; }
     void SetAnyEventCallback(const AnyEventCallback &cb) { _event_callback = cb; }
     void SetSrvClosedCallback(const ClosedCallback &cb) { _server_closed_callback = cb; }
+    // 使用边沿触发，必须在Established之前设置
+    void SetEdgeTrigger(bool on) { _channel.SetEdgeTrigger(on); }
+    // 边沿触发时一次可读事件最多读取bytes字节，0表示读到EAGAIN为止
+    void SetReadBudget(size_t bytes) { _read_budget = bytes; }
+    // 一次消息回调最多处理n条消息，0表示不限制；需要消息回调配合调用ConsumeMessageBudget
+    void SetMessageBudget(uint32_t n) { _message_budget = n; }
+    // 缓冲区收缩：输入缓冲区处理完之后容量超过threshold字节就立即释放，连接空闲idle_ms毫秒释放两个缓冲区多余的内存；
+    // 都是0表示不收缩，必须在Established之前设置
+    void SetBufferShrink(uint32_t idle_ms, uint64_t threshold)
+    {
+        _shrink_idle_ms = idle_ms;
+        _shrink_threshold = threshold;
+    }
+    // 在消息回调中每处理完一条消息调用一次，返回false表示预算用完了，应该直接返回；
+    // 缓冲区中剩下的数据会在稍后重新交给消息回调。连接正在关闭时不限制，尽量把数据处理完
+    bool ConsumeMessageBudget()
+    {
+        if (_message_budget == 0 || _statu != CONNECTED)
+            return true;
+        if (++_messages < _message_budget)
+            return true;
+        if (_resume_pending == false)
+        {
+            _resume_pending = true;
+            _loop->QueueInLoop(std::bind(&Connection::ResumeMessage, shared_from_this()));
+        }
+        return false;
+    }
+    // 把输入缓冲区中还没处理的数据重新交给消息回调，比如异步处理完一个请求之后，继续处理流水线中后面的请求
+    void Resume()
+    {
+        PtrConnection self = shared_from_this();
+        _loop->RunInLoop([self]()
+                         {
+                             if (self->_statu == CONNECTED && self->_in_buffer.ReadAbleSize() > 0)
+                                 self->DeliverMessage(); });
+    }
     // 连接建立就绪后，进行channel回调设置，启动读监控，调用_connected_callback
     void Established()
     {
-        _loop->RunInLoop(std::bind(&Connection::EstablishedInLoop, this));
+        _loop->RunInLoop([this]()
+                         { EstablishedInLoop(); });
     }
     // 发送数据，将数据放到发送缓冲区，启动写事件监控
     void Send(const char *data, size_t len)
     {
         // 外界传入的data，可能是个临时的空间，我们现在只是把发送操作压入了任务池，有可能并没有被立即执行
         // 因此有可能执行的时候，data指向的空间有可能已经被释放了。
+        if (_loop->IsInLoop())
+        {
+            // 在EventLoop线程中（比如消息回调里）直接追加到发送缓冲区，不需要临时缓冲区和任务
+            return SendInLoop(data, len);
+        }
         Buffer buf;
         buf.WriteAndPush(data, len);
-        _loop->RunInLoop(std::bind(&Connection::SendInLoop, this, std::move(buf)));
+        _loop->RunInLoop(std::bind(&Connection::SendBufferInLoop, this, std::move(buf)));
     }
     // 提供给组件使用者的关闭接口--并不实际关闭，需要判断有没有数据待处理
     void Shutdown()
     {
-        _loop->RunInLoop(std::bind(&Connection::ShutdownInLoop, this));
+        _loop->RunInLoop([this]()
+                         { ShutdownInLoop(); });
     }
     void Release()
     {
-        _loop->QueueInLoop(std::bind(&Connection::ReleaseInLoop, this));
+        // 持有shared_ptr：多次投递的释放任务执行时，连接对象可能已经被服务器移除
+        PtrConnection self = shared_from_this();
+        _loop->QueueInLoop([self]()
+                           { self->ReleaseInLoop(); });
     }
     // 启动非活跃销毁，并定义多长时间无通信就是非活跃，添加定时任务
     void EnableInactiveRelease(int sec)
     {
-        _loop->RunInLoop(std::bind(&Connection::EnableInactiveReleaseInLoop, this, sec));
+        _loop->RunInLoop([this, sec]()
+                         { EnableInactiveReleaseInLoop(sec); });
     }
     // 取消非活跃销毁
     void CancelInactiveRelease()
     {
-        _loop->RunInLoop(std::bind(&Connection::CancelInactiveReleaseInLoop, this));
+        _loop->RunInLoop([this]()
+                         { CancelInactiveReleaseInLoop(); });
     }
     // 切换协议---重置上下文以及阶段性回调处理函数 -- 而是这个接口必须在EventLoop线程中立即执行
     // 防备新的事件触发后，处理的时候，切换任务还没有被执行--会导致数据使用原协议处理了。
@@ -298,4 +541,19 @@ public:
         _loop->AssertInLoop();
         _loop->RunInLoop(std::bind(&Connection::UpgradeInLoop, this, context, conn, msg, closed, event));
     }
-};
\ No newline at end of file
+#if __cplusplus >= 202002L
+    /*协程接口（定义在Coroutine.hpp中），只能在连接所属的EventLoop线程中的协程里co_await，恢复时仍在该线程
+     * 同一时刻最多一个协程在读、一个协程在写；有协程在等待数据时不会调用消息回调*/
+    // 读取n字节，连接关闭前没等够返回空串
+    ConnReadAwaiter Read(size_t n);
+    // 读取到delim为止（包含delim），连接关闭或者超过max字节（0表示不限制）还没找到返回空串
+    ConnReadUntilAwaiter ReadUntil(const std::string &delim, size_t max = 0);
+    // 发送数据，等到全部交给内核后恢复，返回false表示连接已经关闭
+    ConnWriteAwaiter Write(const std::string &data);
+    ConnWriteAwaiter Write(const char *data, size_t len);
+#endif
+};
+
+#if __cplusplus >= 202002L
+#include "Coroutine.hpp"
+#endif
\ No newline at end of file
@@ -0,0 +1,448 @@
+#pragma once
+
+/*C++20协程接口：在连接上co_await读写和睡眠，协议处理可以直线式地编写，不需要手写状态机
+ *   CoTask<void> Echo(PtrConnection conn)
+ *   {
+ *       while (conn->Connected())
+ *       {
+ *           std::string line = co_await conn->ReadUntil("\r\n");
+ *           if (line.empty() || !co_await conn->Write(line))
+ *               break;
+ *       }
+ *   }
+ *   server.SetConnectedCallback([](const PtrConnection &conn) { CoSpawn(Echo(conn)); });
+ * 协程总是在连接所属的EventLoop线程中恢复，等待期间不占用线程；协程帧从每个EventLoop线程自己的内存池中分配。*/
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+
+#include "Connection.hpp"
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <string>
+#include <utility>
+
+#define CO_FRAME_ALIGN 64   // 协程帧按64字节分档
+#define CO_FRAME_CLASSES 32 // 最大一档2048字节，更大的帧直接使用operator new
+#define CO_FRAME_CACHE 256  // 每档最多缓存的空闲帧数
+/*协程帧的内存池：每个线程一个，也就是每个EventLoop一个；同一个连接的协程只在它所属的EventLoop线程中创建和销毁，
+ * 不需要加锁。释放的帧挂在对应档的空闲链表上，下一次同样大小的协程直接复用*/
+class CoFramePool
+{
+private:
+    struct FreeFrame
+    {
+        FreeFrame *next;
+    };
+    FreeFrame *_free[CO_FRAME_CLASSES];
+    size_t _count[CO_FRAME_CLASSES];
+
+private:
+    // 线程退出时池先于线程中其他对象析构，之后释放的帧直接使用operator delete
+    static bool &Destroyed()
+    {
+        static thread_local bool destroyed = false;
+        return destroyed;
+    }
+
+public:
+    CoFramePool()
+    {
+        for (int i = 0; i < CO_FRAME_CLASSES; i++)
+        {
+            _free[i] = NULL;
+            _count[i] = 0;
+        }
+    }
+    ~CoFramePool()
+    {
+        for (int i = 0; i < CO_FRAME_CLASSES; i++)
+        {
+            while (_free[i])
+            {
+                FreeFrame *frame = _free[i];
+                _free[i] = frame->next;
+                ::operator delete(frame);
+            }
+            _count[i] = 0;
+        }
+        Destroyed() = true;
+    }
+    // 当前线程的池，线程正在退出（池已经析构）时返回NULL
+    static CoFramePool *Local()
+    {
+        if (Destroyed())
+            return NULL;
+        static thread_local CoFramePool pool;
+        return &pool;
+    }
+    // 从当前线程的池中分配/释放，线程正在退出时直接使用operator new/delete
+    static void *LocalAlloc(size_t size)
+    {
+        CoFramePool *pool = Local();
+        if (pool)
+            return pool->Alloc(size);
+        return ::operator new(size);
+    }
+    static void LocalFree(void *ptr, size_t size)
+    {
+        CoFramePool *pool = Local();
+        if (pool)
+            return pool->Free(ptr, size);
+        ::operator delete(ptr);
+    }
+    void *Alloc(size_t size)
+    {
+        size_t cls = (size + CO_FRAME_ALIGN - 1) / CO_FRAME_ALIGN;
+        if (cls == 0 || cls > CO_FRAME_CLASSES)
+            return ::operator new(size);
+        FreeFrame *&head = _free[cls - 1];
+        if (head == NULL)
+            return ::operator new(cls * CO_FRAME_ALIGN);
+        FreeFrame *frame = head;
+        head = frame->next;
+        _count[cls - 1]--;
+        return frame;
+    }
+    // size必须和分配时相同；在其他线程释放的帧会进入那个线程的内存池，大小分档一致，不影响复用
+    void Free(void *ptr, size_t size)
+    {
+        size_t cls = (size + CO_FRAME_ALIGN - 1) / CO_FRAME_ALIGN;
+        if (cls == 0 || cls > CO_FRAME_CLASSES || _count[cls - 1] >= CO_FRAME_CACHE)
+            return ::operator delete(ptr);
+        FreeFrame *frame = (FreeFrame *)ptr;
+        frame->next = _free[cls - 1];
+        _free[cls - 1] = frame;
+        _count[cls - 1]++;
+    }
+};
+
+// 所有CoTask共用的promise部分：帧分配、结束时的去向、异常
+class CoPromiseBase
+{
+private:
+    // 协程结束：有等待者就直接切换到等待者；分离运行的协程自己释放协程帧
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            CoPromiseBase &promise = handle.promise();
+            if (promise._continuation)
+                return promise._continuation;
+            if (promise._detached)
+                handle.destroy();
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+protected:
+    std::coroutine_handle<> _continuation; // co_await这个协程的协程
+    std::exception_ptr _exception;
+    bool _detached; // 由CoSpawn分离运行，没有人等待结果
+
+public:
+    CoPromiseBase() : _detached(false) {}
+    static void *operator new(size_t size) { return CoFramePool::LocalAlloc(size); }
+    static void operator delete(void *ptr, size_t size) { CoFramePool::LocalFree(ptr, size); }
+    // 创建时不执行，由co_await或者CoSpawn启动
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception()
+    {
+        if (_detached == false)
+        {
+            _exception = std::current_exception();
+            return;
+        }
+        // 分离运行的协程没有人接收异常，记录下来，不影响EventLoop
+        try
+        {
+            throw;
+        }
+        catch (const std::exception &e)
+        {
+            ERR_LOG("COROUTINE EXITED WITH EXCEPTION: %s", e.what());
+        }
+        catch (...)
+        {
+            ERR_LOG("COROUTINE EXITED WITH UNKNOWN EXCEPTION");
+        }
+    }
+    void SetContinuation(std::coroutine_handle<> continuation) { _continuation = continuation; }
+    void SetDetached() { _detached = true; }
+    void RethrowIfFailed()
+    {
+        if (_exception)
+            std::rethrow_exception(_exception);
+    }
+};
+
+template <typename T>
+class CoTask;
+
+template <typename T>
+class CoPromise : public CoPromiseBase
+{
+private:
+    std::optional<T> _value;
+
+public:
+    CoTask<T> get_return_object();
+    template <typename U>
+    void return_value(U &&value) { _value.emplace(std::forward<U>(value)); }
+    T Result()
+    {
+        RethrowIfFailed();
+        return std::move(*_value);
+    }
+};
+
+template <>
+class CoPromise<void> : public CoPromiseBase
+{
+public:
+    CoTask<void> get_return_object();
+    void return_void() {}
+    void Result() { RethrowIfFailed(); }
+};
+
+/*协程的返回类型：co_await一个CoTask会启动它，它结束后直接恢复等待者并取得返回值（或者重新抛出它的异常）
+ * CoTask只能移动；没有被co_await或者CoSpawn的CoTask析构时释放协程帧，协程不会执行*/
+template <typename T = void>
+class CoTask
+{
+public:
+    using promise_type = CoPromise<T>;
+    using Handle = std::coroutine_handle<promise_type>;
+
+private:
+    Handle _handle;
+
+public:
+    explicit CoTask(Handle handle) : _handle(handle) {}
+    CoTask(CoTask &&other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+    CoTask &operator=(CoTask &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (_handle)
+                _handle.destroy();
+            _handle = std::exchange(other._handle, nullptr);
+        }
+        return *this;
+    }
+    CoTask(const CoTask &) = delete;
+    CoTask &operator=(const CoTask &) = delete;
+    ~CoTask()
+    {
+        if (_handle)
+            _handle.destroy();
+    }
+    // 交出协程帧的所有权
+    Handle Release() { return std::exchange(_handle, nullptr); }
+
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller)
+    {
+        _handle.promise().SetContinuation(caller);
+        return _handle; // 对称转移，直接切换到被等待的协程，不增加调用栈
+    }
+    T await_resume() { return _handle.promise().Result(); }
+};
+
+template <typename T>
+CoTask<T> CoPromise<T>::get_return_object() { return CoTask<T>(CoTask<T>::Handle::from_promise(*this)); }
+inline CoTask<void> CoPromise<void>::get_return_object() { return CoTask<void>(CoTask<void>::Handle::from_promise(*this)); }
+
+// 分离运行一个协程：立即在调用线程中开始执行直到第一次挂起，结束时自动释放协程帧
+// 协程中的连接操作要求在连接所属的EventLoop线程中调用，比如连接建立回调、消息回调中
+inline void CoSpawn(CoTask<void> task)
+{
+    CoTask<void>::Handle handle = task.Release();
+    handle.promise().SetDetached();
+    handle.resume();
+}
+
+// 连接等待操作的公共部分：Connection调用wake时检查条件是否满足，满足才恢复协程，否则继续等待
+class ConnAwaiter : public ConnWaiter
+{
+protected:
+    Connection *_conn;
+    std::coroutine_handle<> _handle;
+
+protected:
+    ConnAwaiter(Connection *conn) : _conn(conn)
+    {
+        _conn->_loop->AssertInLoop();
+        wake = NULL;
+    }
+    Buffer &InBuffer() { return _conn->_in_buffer; }
+    bool Closed() { return _conn->_statu == DISCONNECTED; }
+    // 不会再有新的输入数据了（正在关闭或者已经关闭）
+    bool InputEnded() { return _conn->_statu != CONNECTED; }
+    // 发送数据；返回true表示不需要等待：已经全部发送给内核，或者连接已经关闭
+    bool SendNow(const char *data, size_t len)
+    {
+        _conn->SendInLoop(data, len);
+        return Closed() || _conn->_out_buffer.ReadAbleSize() == 0;
+    }
+    void WaitRead()
+    {
+        assert(_conn->_read_waiter == NULL);
+        _conn->_read_waiter = this;
+    }
+    void WaitWrite()
+    {
+        assert(_conn->_write_waiter == NULL);
+        _conn->_write_waiter = this;
+    }
+};
+
+class ConnReadAwaiter : public ConnAwaiter
+{
+private:
+    size_t _n;
+
+private:
+    static void OnWake(ConnWaiter *waiter)
+    {
+        ConnReadAwaiter *self = static_cast<ConnReadAwaiter *>(waiter);
+        if (self->await_ready())
+            return self->_handle.resume();
+        self->WaitRead();
+    }
+
+public:
+    ConnReadAwaiter(Connection *conn, size_t n) : ConnAwaiter(conn), _n(n) { wake = OnWake; }
+    bool await_ready() { return InBuffer().ReadAbleSize() >= _n || InputEnded(); }
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        _handle = handle;
+        WaitRead();
+    }
+    std::string await_resume()
+    {
+        if (InBuffer().ReadAbleSize() < _n)
+            return "";
+        return InBuffer().ReadAsStringAndPop(_n);
+    }
+};
+
+class ConnReadUntilAwaiter : public ConnAwaiter
+{
+private:
+    std::string _delim;
+    size_t _max;
+    size_t _scanned; // 已经查找过、不包含分隔符开头的字节数，新数据到达时不必从头查找
+    size_t _found;   // 包含分隔符在内的长度，0表示还没找到
+
+private:
+    static void OnWake(ConnWaiter *waiter)
+    {
+        ConnReadUntilAwaiter *self = static_cast<ConnReadUntilAwaiter *>(waiter);
+        if (self->await_ready())
+            return self->_handle.resume();
+        self->WaitRead();
+    }
+    bool Search()
+    {
+        Buffer &buf = InBuffer();
+        size_t size = buf.ReadAbleSize();
+        if (_delim.empty() || size < _delim.size())
+            return false;
+        const char *begin = buf.ReadPosition();
+        const char *pos = (const char *)memmem(begin + _scanned, size - _scanned, _delim.data(), _delim.size());
+        if (pos != NULL)
+        {
+            _found = pos - begin + _delim.size();
+            return true;
+        }
+        _scanned = size - _delim.size() + 1;
+        return false;
+    }
+
+public:
+    ConnReadUntilAwaiter(Connection *conn, const std::string &delim, size_t max) : ConnAwaiter(conn), _delim(delim),
+                                                                                   _max(max), _scanned(0), _found(0)
+    {
+        wake = OnWake;
+    }
+    bool await_ready()
+    {
+        if (Search())
+            return true;
+        return InputEnded() || (_max > 0 && InBuffer().ReadAbleSize() > _max);
+    }
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        _handle = handle;
+        WaitRead();
+    }
+    std::string await_resume()
+    {
+        if (_found == 0 || (_max > 0 && _found > _max))
+            return "";
+        return InBuffer().ReadAsStringAndPop(_found);
+    }
+};
+
+class ConnWriteAwaiter : public ConnAwaiter
+{
+private:
+    const char *_data;
+    size_t _len;
+
+private:
+    static void OnWake(ConnWaiter *waiter)
+    {
+        ConnWriteAwaiter *self = static_cast<ConnWriteAwaiter *>(waiter);
+        self->_handle.resume();
+    }
+
+public:
+    ConnWriteAwaiter(Connection *conn, const char *data, size_t len) : ConnAwaiter(conn), _data(data), _len(len)
+    {
+        wake = OnWake;
+    }
+    // 数据在这里就复制到了发送缓冲区，之后不再引用调用者的内存
+    bool await_ready() { return SendNow(_data, _len); }
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        _handle = handle;
+        WaitWrite();
+    }
+    bool await_resume() { return !Closed(); }
+};
+
+inline ConnReadAwaiter Connection::Read(size_t n) { return ConnReadAwaiter(this, n); }
+inline ConnReadUntilAwaiter Connection::ReadUntil(const std::string &delim, size_t max)
+{
+    return ConnReadUntilAwaiter(this, delim, max);
+}
+inline ConnWriteAwaiter Connection::Write(const std::string &data) { return ConnWriteAwaiter(this, data.data(), data.size()); }
+inline ConnWriteAwaiter Connection::Write(const char *data, size_t len) { return ConnWriteAwaiter(this, data, len); }
+
+// 在当前EventLoop中睡眠ms毫秒，由定时器恢复，只能在EventLoop线程中的协程里使用
+class SleepAwaiter
+{
+private:
+    uint32_t _ms;
+
+public:
+    SleepAwaiter(uint32_t ms) : _ms(ms) {}
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        EventLoop *loop = EventLoop::Current();
+        assert(loop != NULL);
+        loop->RunAfter(_ms, [handle]()
+                       { handle.resume(); });
+    }
+    void await_resume() {}
+};
+inline SleepAwaiter SleepFor(uint32_t ms) { return SleepAwaiter(ms); }
+
+#endif
@@ -1,17 +1,23 @@
 #pragma once
 
 #include "Log.hpp"
+#include "Watchdog.hpp"
 
 #include <unistd.h>
 #include <string.h>
 #include <vector>
 #include <unordered_map>
+#include <cstdint>
 
 #include <sys/epoll.h>
 #include <functional>
+#include <memory>
+#include <algorithm>
+#include <typeinfo>
 
 class Poller; // 前向声明
 class EventLoop;
+#define CHANNEL_UNSYNCED UINT32_MAX
 class Channel
 {
 private:
@@ -20,23 +26,118 @@ private:
 
     uint32_t _events;  // 当前需要监控的事件
     uint32_t _revents; // 当前连接触发的事件
+    bool _registered;  // 是否已经添加到了epoll中，决定使用EPOLL_CTL_ADD还是EPOLL_CTL_MOD
+    /*Update并不立即修改内核中的监控，而是在下一次事件监控之前统一提交一次，
+     * 一轮中反复开关可写监控、最终没有变化的，就不需要任何系统调用*/
+    uint32_t _kernel_events; // 最后一次提交给内核的事件，CHANNEL_UNSYNCED表示还没有提交过
+    bool _dirty;             // 是否已经在EventLoop的待提交列表中
+    uint64_t _tag;           // 使用者的标识（Connection设置为连接ID），看门狗报告卡顿时使用
 
     using EventCallback = std::function<void()>;
-    EventCallback _read_callback;  // 可读事件被触发的回调函数
-    EventCallback _write_callback; // 可写事件被触发的回调函数
-    EventCallback _error_callback; // 错误事件被触发的回调函数
-    EventCallback _close_callback; // 连接断开事件被触发的回调函数
-    EventCallback _event_callback; // 任意事件被触发的回调函数
+    /*以下两个回调只有io_uring后端会使用：由内核直接完成accept/recv，再把结果交给使用者*/
+    using AcceptCallback = std::function<void(int)>;
+    using RecvCallback = std::function<void(const char *, ssize_t)>;
+    struct Callbacks
+    {
+        EventCallback read;      // 可读事件被触发的回调函数
+        EventCallback write;     // 可写事件被触发的回调函数
+        EventCallback error;     // 错误事件被触发的回调函数
+        EventCallback close;     // 连接断开事件被触发的回调函数
+        EventCallback event;     // 任意事件被触发的回调函数
+        AcceptCallback accept;   // 多次accept完成的回调，参数为新连接描述符
+        RecvCallback recv;       // 多次recv完成的回调，长度<=0表示连接断开或出错
+    };
+    /*两种设置处理函数的方式：
+     * 1. SetHandler：直接调用处理对象的成员函数，通过模板生成的函数指针分发，没有std::function，也不需要分配内存，
+     *    连接数量很多的Connection使用这种方式；
+     * 2. Set*Callback：std::function回调，第一次设置时才分配，用于eventfd、timerfd、监听套接字等少量的Channel*/
+    using EventDispatch = void (*)(void *, Channel *);
+    using RecvDispatch = void (*)(void *, const char *, ssize_t);
+    void *_handler;
+    const char *_handler_name; // 处理对象的类型名，看门狗报告卡顿时使用
+    EventDispatch _event_dispatch;
+    RecvDispatch _recv_dispatch;
+    std::unique_ptr<Callbacks> _callbacks;
+
+private:
+    LoopHeartbeat *Heartbeat();
+    // 事件处理函数的类型名：处理对象的类型，或者读回调中保存的可调用对象的类型
+    const char *CallbackName()
+    {
+        if (_handler_name)
+            return _handler_name;
+        if (_callbacks && _callbacks->read)
+            return _callbacks->read.target_type().name();
+        return NULL;
+    }
+    Callbacks &GetCallbacks()
+    {
+        if (!_callbacks)
+            _callbacks.reset(new Callbacks());
+        return *_callbacks;
+    }
+    template <typename Handler>
+    static void DispatchEvent(void *handler, Channel *channel)
+    {
+        Handler *h = static_cast<Handler *>(handler);
+        uint32_t revents = channel->_revents;
+        if ((revents & EPOLLIN) || (revents & EPOLLRDHUP) || (revents & EPOLLPRI))
+            h->HandleRead();
+        /*有可能会释放连接的操作事件，一次只处理一个*/
+        if (revents & EPOLLOUT)
+            h->HandleWrite();
+        else if (revents & EPOLLERR)
+            h->HandleError();
+        else if (revents & EPOLLHUP)
+            h->HandleClose();
+        h->HandleEvent();
+    }
+    template <typename Handler>
+    static void DispatchRecv(void *handler, const char *data, ssize_t len)
+    {
+        Handler *h = static_cast<Handler *>(handler);
+        h->HandleRecv(data, len);
+        h->HandleEvent();
+    }
+
 public:
-    Channel(EventLoop *loop, int fd) : _fd(fd), _events(0), _revents(0), _loop(loop) {}
+    Channel(EventLoop *loop, int fd) : _fd(fd), _loop(loop), _events(0), _revents(0), _registered(false),
+                                       _kernel_events(CHANNEL_UNSYNCED), _dirty(false), _tag(0),
+                                       _handler(NULL), _handler_name(NULL), _event_dispatch(NULL), _recv_dispatch(NULL) {}
     int Fd() { return _fd; }
     uint32_t Events() { return _events; }                   // 获取想要监控的事件
     void SetREvents(uint32_t events) { _revents = events; } // 设置实际就绪的事件
-    void SetReadCallback(const EventCallback &cb) { _read_callback = cb; }
-    void SetWriteCallback(const EventCallback &cb) { _write_callback = cb; }
-    void SetErrorCallback(const EventCallback &cb) { _error_callback = cb; }
-    void SetCloseCallback(const EventCallback &cb) { _close_callback = cb; }
-    void SetEventCallback(const EventCallback &cb) { _event_callback = cb; }
+    void SetReadCallback(const EventCallback &cb) { GetCallbacks().read = cb; }
+    void SetWriteCallback(const EventCallback &cb) { GetCallbacks().write = cb; }
+    void SetErrorCallback(const EventCallback &cb) { GetCallbacks().error = cb; }
+    void SetCloseCallback(const EventCallback &cb) { GetCallbacks().close = cb; }
+    void SetEventCallback(const EventCallback &cb) { GetCallbacks().event = cb; }
+    void SetAcceptCallback(const AcceptCallback &cb) { GetCallbacks().accept = cb; }
+    void SetRecvCallback(const RecvCallback &cb) { GetCallbacks().recv = cb; }
+    void SetTag(uint64_t tag) { _tag = tag; }
+    // 设置处理对象：事件就绪时直接调用handler的HandleRead/HandleWrite/HandleError/HandleClose/HandleEvent，
+    // io_uring收到数据时调用HandleRecv；这些函数不是公有的话，需要把Channel声明为友元。设置之后不再使用回调
+    template <typename Handler>
+    void SetHandler(Handler *handler)
+    {
+        _handler = handler;
+        _handler_name = typeid(Handler).name();
+        _event_dispatch = &Channel::DispatchEvent<Handler>;
+        _recv_dispatch = &Channel::DispatchRecv<Handler>;
+    }
+    bool HasAcceptCallback() { return _callbacks && _callbacks->accept; }
+    bool HasRecvCallback() { return _recv_dispatch != NULL || (_callbacks && _callbacks->recv); }
+    uint32_t REvents() { return _revents; }
+    bool Registered() { return _registered; }
+    void SetRegistered(bool registered) { _registered = registered; }
+    uint32_t KernelEvents() { return _kernel_events; }
+    void SetKernelEvents(uint32_t events) { _kernel_events = events; }
+    bool Dirty() { return _dirty; }
+    void SetDirty(bool dirty) { _dirty = dirty; }
+    // 设置边沿触发，下一次Update时生效；同时监控EPOLLRDHUP，对端关闭和最后的数据同时到达时也能知道还有一个EOF要读
+    void SetEdgeTrigger(bool on) { on ? (_events |= EPOLLET | EPOLLRDHUP) : (_events &= ~(EPOLLET | EPOLLRDHUP)); }
+    // 当前是否为边沿触发
+    bool EdgeTrigger() { return (_events & EPOLLET); }
     // 当前是否监控了可读
     bool ReadAble() { return (_events & EPOLLIN); }
     // 当前是否监控了可写
@@ -77,42 +178,105 @@ public:
     // 事件处理，一旦连接触发了事件，就调用这个函数，自己触发了什么事件如何处理自己决定
     void HandleEvent()
     {
+        LoopHeartbeat *heartbeat = Heartbeat();
+        LoopBeat beat(heartbeat, BEAT_EVENT, _fd, _revents, _tag, heartbeat ? CallbackName() : NULL);
+        if (_event_dispatch)
+            return _event_dispatch(_handler, this);
+        if (!_callbacks)
+            return;
+        Callbacks &cbs = *_callbacks;
         // EPOLLRDHUP     用于检测 TCP 连接的对端关闭连接的情况，特别是半关闭（half-close）状态。
         // EPOLLPRI       用于监控文件描述符上的紧急数据（带外数据）
         if ((_revents & EPOLLIN) || (_revents & EPOLLRDHUP) || (_revents & EPOLLPRI))
         {
             /*不管任何事件，都调用的回调函数*/
-            if (_read_callback)
-                _read_callback();
+            if (cbs.read)
+                cbs.read();
         }
         /*有可能会释放连接的操作事件，一次只处理一个*/
         if (_revents & EPOLLOUT)
         {
-            if (_write_callback)
-                _write_callback();
+            if (cbs.write)
+                cbs.write();
         }
         else if (_revents & EPOLLERR)
         {
-            if (_error_callback)
-                _error_callback(); // 一旦出错，就会释放连接，因此要放到前边调用任意回调
+            if (cbs.error)
+                cbs.error(); // 一旦出错，就会释放连接，因此要放到前边调用任意回调
         }
         // 用于表示文件描述符对应的设备或流发生了挂起（hang up）事件，在网络编程里，一般意味着连接被关闭或者异常断开。
         else if (_revents & EPOLLHUP)
         {
-            if (_close_callback)
-                _close_callback();
+            if (cbs.close)
+                cbs.close();
         }
-        if (_event_callback)
-            _event_callback();
+        if (cbs.event)
+            cbs.event();
+    }
+    // io_uring后端：内核已经替我们accept到了新连接
+    void HandleAccept(int fd)
+    {
+        LoopHeartbeat *heartbeat = Heartbeat();
+        LoopBeat beat(heartbeat, BEAT_ACCEPT, _fd, 0, _tag, heartbeat ? CallbackName() : NULL);
+        if (!_callbacks)
+            return;
+        if (_callbacks->accept)
+            _callbacks->accept(fd);
+        if (_callbacks->event)
+            _callbacks->event();
+    }
+    // io_uring后端：内核已经把数据收到了提供的缓冲区中
+    void HandleRecv(const char *data, ssize_t len)
+    {
+        LoopHeartbeat *heartbeat = Heartbeat();
+        LoopBeat beat(heartbeat, BEAT_RECV, _fd, 0, _tag, heartbeat ? CallbackName() : NULL);
+        if (_recv_dispatch)
+            return _recv_dispatch(_handler, data, len);
+        if (!_callbacks)
+            return;
+        if (_callbacks->recv)
+            _callbacks->recv(data, len);
+        if (_callbacks->event)
+            _callbacks->event();
     }
 };
-#define MAX_EPOLLEVENTS 1024
+typedef enum
+{
+    POLLER_EPOLL, // 默认的epoll后端
+    POLLER_URING, // io_uring后端：多次poll、多次accept以及使用提供缓冲区的多次recv
+} PollerType;
+
+// Poller接口：不同的后端只需要实现添加/修改、移除以及开始监控三个操作
 class Poller
 {
+public:
+    virtual ~Poller() {}
+    // 添加或修改监控事件
+    virtual void UpdateEvent(Channel *channel) = 0;
+    // 移除监控
+    virtual void RemoveEvent(Channel *channel) = 0;
+    // 开始监控，返回活跃连接；timeout为毫秒，-1表示一直阻塞，0表示不阻塞
+    virtual void Poll(std::vector<Channel *> *active, int timeout) = 0;
+    // 处理内核替我们完成的accept/recv，只有io_uring后端才有
+    virtual void HandleCompletions() {}
+    // 还没处理的完成事件个数，忙轮询时用来判断这一轮有没有收获
+    virtual size_t PendingCompletions() { return 0; }
+};
+
+#define MAX_EPOLLEVENTS 1024     // 就绪事件数组的初始（也是最小）长度
+#define EPOLL_EVENTS_LIMIT 65536  // 就绪事件数组的最大长度
+#define EPOLL_SHRINK_ROUNDS 256   // 连续这么多轮就绪事件都不到长度的1/4，就把数组减半
+// epoll_event.data.ptr中直接保存Channel指针，就绪时不需要再通过fd查表；
+// 是否已经添加过由Channel自己记录。
+// Channel的释放都是通过任务池延迟到本轮事件处理之后的，因此同一批就绪事件中的指针不会悬空。
+class EpollPoller : public Poller
+{
 private:
     int _epfd;
-    struct epoll_event _evs[MAX_EPOLLEVENTS];
-    std::unordered_map<int, Channel *> _channels;
+    /*就绪事件数组的长度自适应：一轮就把数组填满了，说明还有就绪事件没取到，加倍；
+     * 之后一直用不到那么多就减半，避免每轮都让内核和缓存面对一个很大的数组*/
+    std::vector<struct epoll_event> _evs;
+    int _small_rounds; // 连续就绪事件很少的轮数
 
 private:
     // 对epoll的直接操作
@@ -121,7 +285,7 @@ private:
         // int epoll_ctl(int epfd, int op,  int fd,  struct epoll_event *ev);
         int fd = channel->Fd();
         struct epoll_event ev;
-        ev.data.fd = fd;
+        ev.data.ptr = channel;
         ev.events = channel->Events();
         int ret = epoll_ctl(_epfd, op, fd, &ev);
         if (ret < 0)
@@ -130,19 +294,32 @@ private:
         }
         return;
     }
-    // 判断一个Channel是否已经添加了事件监控
-    bool HasChannel(Channel *channel)
+    // 根据这一轮的就绪事件数调整数组长度；超时返回的（包括忙轮询的空转）不算
+    void Resize(int nfds)
     {
-        auto it = _channels.find(channel->Fd());
-        if (it == _channels.end())
+        int size = (int)_evs.size();
+        if (nfds == size && size < EPOLL_EVENTS_LIMIT)
         {
-            return false;
+            _evs.resize(size * 2);
+            _small_rounds = 0;
+            return;
         }
-        return true;
+        if (nfds == 0 || size <= MAX_EPOLLEVENTS)
+            return;
+        if (nfds >= size / 4)
+        {
+            _small_rounds = 0;
+            return;
+        }
+        if (++_small_rounds < EPOLL_SHRINK_ROUNDS)
+            return;
+        _evs.resize(size / 2);
+        _evs.shrink_to_fit();
+        _small_rounds = 0;
     }
 
 public:
-    Poller()
+    EpollPoller() : _evs(MAX_EPOLLEVENTS), _small_rounds(0)
     {
         _epfd = epoll_create(MAX_EPOLLEVENTS);
         if (_epfd < 0)
@@ -151,14 +328,14 @@ public:
             abort(); // 退出程序
         }
     }
+    ~EpollPoller() { close(_epfd); }
     // 添加或修改监控事件
     void UpdateEvent(Channel *channel)
     {
-        bool ret = HasChannel(channel);
-        if (ret == false)
+        if (channel->Registered() == false)
         {
             // 不存在则添加
-            _channels.insert(std::make_pair(channel->Fd(), channel));
+            channel->SetRegistered(true);
             return Update(channel, EPOLL_CTL_ADD);
         }
         return Update(channel, EPOLL_CTL_MOD);
@@ -166,18 +343,19 @@ public:
     // 移除监控
     void RemoveEvent(Channel *channel)
     {
-        auto it = _channels.find(channel->Fd());
-        if (it != _channels.end())
+        if (channel->Registered() == false)
         {
-            _channels.erase(it);
+            return;
         }
+        channel->SetRegistered(false);
         Update(channel, EPOLL_CTL_DEL);
     }
     // 开始监控，返回活跃连接
-    void Poll(std::vector<Channel *> *active)
+    void Poll(std::vector<Channel *> *active, int timeout)
     {
         // int epoll_wait(int epfd, struct epoll_event *evs, int maxevents, int timeout)
-        int nfds = epoll_wait(_epfd, _evs, MAX_EPOLLEVENTS, -1);
+        int size = (int)_evs.size();
+        int nfds = epoll_wait(_epfd, _evs.data(), size, timeout);
         if (nfds < 0)
         {
             if (errno == EINTR)
@@ -189,15 +367,494 @@ public:
         }
         for (int i = 0; i < nfds; i++)
         {
-            auto it = _channels.find(_evs[i].data.fd);
-            assert(it != _channels.end());
-            it->second->SetREvents(_evs[i].events); // 设置实际就绪的事件
-            active->push_back(it->second);
+            Channel *channel = (Channel *)_evs[i].data.ptr;
+            channel->SetREvents(_evs[i].events); // 设置实际就绪的事件
+            active->push_back(channel);
         }
+        Resize(nfds);
         return;
     }
 };
 
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define URING_ENTRIES 1024   // 提交队列长度，完成队列是它的4倍
+#define URING_BUF_COUNT 256  // 提供给内核的接收缓冲区个数，必须是2的幂
+#define URING_BUF_SIZE 16384 // 每个接收缓冲区的大小
+#define URING_BUF_GROUP 0    // 接收缓冲区的组ID
+
+/*io_uring后端：
+ * 1. 普通描述符使用多次poll(IORING_POLL_ADD_MULTI)，一次提交，持续上报就绪事件；
+ * 2. 设置了AcceptCallback的监听描述符使用多次accept，内核直接返回新连接；
+ * 3. 设置了RecvCallback的通信描述符使用多次recv+提供缓冲区，内核直接把数据收好，省掉了recv系统调用。
+ * 所有的提交都在下一次等待时随同一次io_uring_enter一起完成。
+ * 注意：多次poll只在状态变化时上报，语义接近边沿触发，回调中应尽量把数据处理完。
+ * 内核不支持多次recv/accept时，这些描述符退回到poll，而它们的回调（水平触发的HandleRead、Acceptor）一次事件只读/接受一次，
+ * 因此这种情况下使用单次poll，每次完成后重新提交，剩下的数据或连接在下一轮立即再次上报，得到水平触发的语义。*/
+class UringPoller : public Poller
+{
+private:
+    enum
+    {
+        OP_POLL = 0,
+        OP_RECV = 1,
+        OP_ACCEPT = 2,
+        OP_CANCEL = 3,
+    };
+    // 每个描述符的提交状态，按fd下标存放；gen用于丢弃已经取消的请求残留的完成事件
+    struct Entry
+    {
+        Channel *channel;
+        uint32_t gen[3];
+        bool armed[3];
+        uint32_t poll_mask;
+        bool poll_level; // 使用单次poll（水平触发语义）
+        uint64_t round;
+    };
+    struct Completion
+    {
+        uint64_t user_data;
+        int res;
+        uint32_t flags;
+    };
+    int _ringfd;
+    void *_sq_ptr;
+    void *_cq_ptr;
+    size_t _sq_len;
+    size_t _cq_len;
+    struct io_uring_sqe *_sqes;
+    size_t _sqes_len;
+    unsigned *_sq_head;
+    unsigned *_sq_tail;
+    unsigned *_sq_array;
+    unsigned _sq_mask;
+    unsigned _sq_entries;
+    unsigned _sq_local_tail; // 已经填好但还没有告诉内核的提交位置
+    unsigned *_cq_head;
+    unsigned *_cq_tail;
+    unsigned _cq_mask;
+    struct io_uring_cqe *_cqes;
+
+    struct io_uring_buf *_buf_ring; // 提供给内核的缓冲区环
+    char *_bufs;                    // 缓冲区实际的内存
+    uint16_t _buf_tail;
+    bool _recv_multishot;   // 内核是否支持多次recv+提供缓冲区
+    bool _accept_multishot; // 内核是否支持多次accept
+
+    uint64_t _round; // 第几次Poll，用于同一次Poll中合并同一个描述符的多个poll完成事件
+    std::vector<Entry> _entries;
+    std::vector<Completion> _completions;
+    std::vector<int> _rearm; // 多次请求被内核终止，需要重新提交的描述符
+
+private:
+    static uint64_t UserData(int fd, int op, uint32_t gen)
+    {
+        return (uint64_t)(uint32_t)fd | ((uint64_t)op << 32) | ((uint64_t)(gen & 0x3FFFFFFF) << 34);
+    }
+    static int DataFd(uint64_t data) { return (int)(uint32_t)data; }
+    static int DataOp(uint64_t data) { return (int)((data >> 32) & 0x3); }
+    static uint32_t DataGen(uint64_t data) { return (uint32_t)(data >> 34); }
+
+    int Enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+    {
+        return (int)syscall(__NR_io_uring_enter, _ringfd, to_submit, min_complete, flags, NULL, 0);
+    }
+    // 带超时的等待
+    int EnterTimeout(unsigned to_submit, int timeout)
+    {
+        struct __kernel_timespec ts;
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        return (int)syscall(__NR_io_uring_enter, _ringfd, to_submit, 1,
+                            IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+    unsigned Pending() { return _sq_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE); }
+    void FlushSq() { __atomic_store_n(_sq_tail, _sq_local_tail, __ATOMIC_RELEASE); }
+    unsigned CqReady() { return __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE) - *_cq_head; }
+    // 获取一个空闲的提交项，提交队列满了就先提交一次
+    struct io_uring_sqe *GetSqe()
+    {
+        if (Pending() >= _sq_entries)
+        {
+            FlushSq();
+            if (Enter(Pending(), 0, 0) < 0)
+            {
+                ERR_LOG("IO_URING SUBMIT FAILED:%s", strerror(errno));
+                abort();
+            }
+        }
+        unsigned idx = _sq_local_tail & _sq_mask;
+        struct io_uring_sqe *sqe = &_sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        _sq_array[idx] = idx;
+        _sq_local_tail++;
+        return sqe;
+    }
+    void Arm(int fd, int op)
+    {
+        Entry &e = _entries[fd];
+        struct io_uring_sqe *sqe = GetSqe();
+        sqe->fd = fd;
+        sqe->user_data = UserData(fd, op, e.gen[op]);
+        if (op == OP_POLL)
+        {
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = e.poll_mask;
+            if (e.poll_level == false)
+                sqe->len = IORING_POLL_ADD_MULTI;
+        }
+        else if (op == OP_RECV)
+        {
+            sqe->opcode = IORING_OP_RECV;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = URING_BUF_GROUP;
+        }
+        else
+        {
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        }
+        e.armed[op] = true;
+    }
+    void Cancel(int fd, int op)
+    {
+        Entry &e = _entries[fd];
+        struct io_uring_sqe *sqe = GetSqe();
+        sqe->opcode = (op == OP_POLL) ? IORING_OP_POLL_REMOVE : IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = UserData(fd, op, e.gen[op]);
+        sqe->user_data = UserData(fd, OP_CANCEL, 0);
+        e.gen[op]++; // 之后再收到这个请求的完成事件，就直接丢弃
+        e.armed[op] = false;
+    }
+    // 根据Channel想要监控的事件，调整已经提交给内核的请求
+    void Sync(int fd)
+    {
+        Entry &e = _entries[fd];
+        Channel *channel = e.channel;
+        uint32_t events = channel ? channel->Events() : 0;
+        bool want_accept = _accept_multishot && (events & EPOLLIN) && channel->HasAcceptCallback();
+        bool want_recv = _recv_multishot && (events & EPOLLIN) && channel->HasRecvCallback();
+        uint32_t mask = events & ~(EPOLLET | EPOLLONESHOT | EPOLLEXCLUSIVE | EPOLLWAKEUP);
+        if (want_accept || want_recv)
+            mask &= ~EPOLLIN;
+        // 本该由多次recv/accept处理的可读事件退回到了poll，并且不是边沿触发：回调一次只处理一部分，需要水平触发
+        bool level = (mask & EPOLLIN) && (events & EPOLLET) == 0 && channel &&
+                     (channel->HasAcceptCallback() || channel->HasRecvCallback());
+        if (e.armed[OP_POLL] && (e.poll_mask != mask || e.poll_level != level))
+            Cancel(fd, OP_POLL);
+        e.poll_mask = mask;
+        e.poll_level = level;
+        if (mask != 0 && e.armed[OP_POLL] == false)
+            Arm(fd, OP_POLL);
+        if (e.armed[OP_RECV] != want_recv)
+            want_recv ? Arm(fd, OP_RECV) : Cancel(fd, OP_RECV);
+        if (e.armed[OP_ACCEPT] != want_accept)
+            want_accept ? Arm(fd, OP_ACCEPT) : Cancel(fd, OP_ACCEPT);
+    }
+    // 把用完的接收缓冲区还给内核
+    void RecycleBuffer(uint16_t bid)
+    {
+        struct io_uring_buf *buf = &_buf_ring[_buf_tail & (URING_BUF_COUNT - 1)];
+        buf->addr = (uint64_t)(uintptr_t)(_bufs + (size_t)bid * URING_BUF_SIZE);
+        buf->len = URING_BUF_SIZE;
+        buf->bid = bid;
+        _buf_tail++;
+    }
+    void PublishBuffers()
+    {
+        // 环的tail与第一个io_uring_buf的resv字段重叠
+        __atomic_store_n(&_buf_ring[0].resv, _buf_tail, __ATOMIC_RELEASE);
+    }
+    bool SetupRing()
+    {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+        p.cq_entries = URING_ENTRIES * 4;
+        _ringfd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+        if (_ringfd < 0 && errno == EINVAL)
+        {
+            // 老内核不支持COOP_TASKRUN
+            memset(&p, 0, sizeof(p));
+            p.flags = IORING_SETUP_CQSIZE;
+            p.cq_entries = URING_ENTRIES * 4;
+            _ringfd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+        }
+        if (_ringfd < 0)
+        {
+            ERR_LOG("IO_URING SETUP FAILED:%s", strerror(errno));
+            return false;
+        }
+        _sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        _cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            _sq_len = _cq_len = (_sq_len > _cq_len ? _sq_len : _cq_len);
+        _sq_ptr = mmap(NULL, _sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_SQ_RING);
+        if (_sq_ptr == MAP_FAILED)
+            return false;
+        _cq_ptr = _sq_ptr;
+        if ((p.features & IORING_FEAT_SINGLE_MMAP) == 0)
+        {
+            _cq_ptr = mmap(NULL, _cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_CQ_RING);
+            if (_cq_ptr == MAP_FAILED)
+                return false;
+        }
+        _sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+        void *sqes = mmap(NULL, _sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return false;
+        _sqes = (struct io_uring_sqe *)sqes;
+        char *sq = (char *)_sq_ptr;
+        char *cq = (char *)_cq_ptr;
+        _sq_head = (unsigned *)(sq + p.sq_off.head);
+        _sq_tail = (unsigned *)(sq + p.sq_off.tail);
+        _sq_array = (unsigned *)(sq + p.sq_off.array);
+        _sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+        _sq_entries = p.sq_entries;
+        _sq_local_tail = *_sq_tail;
+        _cq_head = (unsigned *)(cq + p.cq_off.head);
+        _cq_tail = (unsigned *)(cq + p.cq_off.tail);
+        _cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+        _cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+        return true;
+    }
+    // 注册提供缓冲区环，失败则退回到poll+recv的方式
+    bool SetupBufRing()
+    {
+        size_t ring_len = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+        void *ring = mmap(NULL, ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED)
+            return false;
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)(uintptr_t)ring;
+        reg.ring_entries = URING_BUF_COUNT;
+        reg.bgid = URING_BUF_GROUP;
+        if (syscall(__NR_io_uring_register, _ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        {
+            DBG_LOG("IO_URING PBUF_RING UNSUPPORTED:%s", strerror(errno));
+            munmap(ring, ring_len);
+            return false;
+        }
+        _buf_ring = (struct io_uring_buf *)ring;
+        _bufs = new char[(size_t)URING_BUF_COUNT * URING_BUF_SIZE];
+        _buf_tail = 0;
+        for (int i = 0; i < URING_BUF_COUNT; i++)
+        {
+            RecycleBuffer(i);
+        }
+        PublishBuffers();
+        return true;
+    }
+    // 多次请求被内核终止（不再带IORING_CQE_F_MORE），之后需要重新提交
+    void Terminated(int fd, int op)
+    {
+        _entries[fd].armed[op] = false;
+        _rearm.push_back(fd);
+    }
+    bool Valid(uint64_t data)
+    {
+        int fd = DataFd(data);
+        int op = DataOp(data);
+        if (op == OP_CANCEL || fd < 0 || fd >= (int)_entries.size())
+            return false;
+        Entry &e = _entries[fd];
+        return e.channel != NULL && (e.gen[op] & 0x3FFFFFFF) == DataGen(data);
+    }
+    void Reap(std::vector<Channel *> *active)
+    {
+        unsigned head = *_cq_head;
+        unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+        _round++;
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &_cqes[head & _cq_mask];
+            uint64_t data = cqe->user_data;
+            if (DataOp(data) != OP_POLL)
+            {
+                // accept/recv的结果放到事件处理阶段再交给Channel，避免在等待阶段执行用户回调
+                if (DataOp(data) != OP_CANCEL)
+                    _completions.push_back(Completion{data, cqe->res, cqe->flags});
+                continue;
+            }
+            if (Valid(data) == false)
+                continue;
+            int fd = DataFd(data);
+            Entry &e = _entries[fd];
+            if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+                Terminated(fd, OP_POLL);
+            if (cqe->res <= 0)
+                continue;
+            if (e.round != _round)
+            {
+                e.round = _round;
+                e.channel->SetREvents(cqe->res); // 设置实际就绪的事件
+                active->push_back(e.channel);
+            }
+            else
+            {
+                e.channel->SetREvents(e.channel->REvents() | cqe->res);
+            }
+        }
+        __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+    }
+    void DispatchRecv(const Completion &c)
+    {
+        int fd = DataFd(c.user_data);
+        bool valid = Valid(c.user_data);
+        bool more = c.flags & IORING_CQE_F_MORE;
+        if (c.flags & IORING_CQE_F_BUFFER)
+        {
+            uint16_t bid = c.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (valid && c.res > 0)
+                _entries[fd].channel->HandleRecv(_bufs + (size_t)bid * URING_BUF_SIZE, c.res);
+            RecycleBuffer(bid);
+        }
+        else if (valid && c.res == -EINVAL)
+        {
+            // 内核不支持多次recv，退回到poll+recv
+            DBG_LOG("IO_URING MULTISHOT RECV UNSUPPORTED");
+            _recv_multishot = false;
+        }
+        else if (valid && c.res != -ENOBUFS && c.res != -ECANCELED)
+        {
+            // 对端关闭(0)或者出错(<0)，不再重新提交
+            _entries[fd].channel->HandleRecv(NULL, c.res == 0 ? 0 : -1);
+            if (Valid(c.user_data))
+                _entries[fd].armed[OP_RECV] = false;
+            return;
+        }
+        // 通道可能在回调中被移除或重新提交，因此要重新校验
+        if (more == false && Valid(c.user_data))
+            Terminated(fd, OP_RECV);
+    }
+    void DispatchAccept(const Completion &c)
+    {
+        if (Valid(c.user_data) == false)
+        {
+            if (c.res >= 0)
+                close(c.res); // 监听描述符已经移除，新连接没人管了
+            return;
+        }
+        int fd = DataFd(c.user_data);
+        if (c.res >= 0)
+        {
+            _entries[fd].channel->HandleAccept(c.res);
+        }
+        else if (c.res == -EINVAL)
+        {
+            DBG_LOG("IO_URING MULTISHOT ACCEPT UNSUPPORTED");
+            _accept_multishot = false;
+        }
+        else
+        {
+            ERR_LOG("IO_URING ACCEPT FAILED:%s", strerror(-c.res));
+        }
+        if ((c.flags & IORING_CQE_F_MORE) == 0 && Valid(c.user_data))
+            Terminated(fd, OP_ACCEPT);
+    }
+
+public:
+    UringPoller() : _ringfd(-1), _sq_ptr(MAP_FAILED), _cq_ptr(MAP_FAILED), _sq_len(0), _cq_len(0),
+                    _sqes(NULL), _sqes_len(0), _buf_ring(NULL), _bufs(NULL), _buf_tail(0),
+                    _recv_multishot(false), _accept_multishot(false), _round(0)
+    {
+        if (SetupRing() == false)
+        {
+            return;
+        }
+        _recv_multishot = SetupBufRing();
+        _accept_multishot = true;
+    }
+    ~UringPoller()
+    {
+        if (_sqes)
+            munmap(_sqes, _sqes_len);
+        if (_cq_ptr != MAP_FAILED && _cq_ptr != _sq_ptr)
+            munmap(_cq_ptr, _cq_len);
+        if (_sq_ptr != MAP_FAILED)
+            munmap(_sq_ptr, _sq_len);
+        if (_buf_ring)
+            munmap(_buf_ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+        delete[] _bufs;
+        if (_ringfd >= 0)
+            close(_ringfd);
+    }
+    // io_uring是否可用（内核不支持或被禁用时，EventLoop会退回epoll）
+    bool Usable() { return _sqes != NULL; }
+    void UpdateEvent(Channel *channel)
+    {
+        int fd = channel->Fd();
+        if (fd >= (int)_entries.size())
+        {
+            Entry e;
+            memset(&e, 0, sizeof(e));
+            _entries.resize(fd + 1, e);
+        }
+        _entries[fd].channel = channel;
+        Sync(fd);
+    }
+    void RemoveEvent(Channel *channel)
+    {
+        int fd = channel->Fd();
+        if (fd >= (int)_entries.size() || _entries[fd].channel != channel)
+        {
+            return;
+        }
+        _entries[fd].channel = NULL;
+        Sync(fd); // 没有Channel了，所有已提交的请求都会被取消
+    }
+    void Poll(std::vector<Channel *> *active, int timeout)
+    {
+        FlushSq();
+        bool ready = CqReady() > 0;
+        unsigned submit = Pending();
+        if (ready == false || submit)
+        {
+            // 使用了COOP_TASKRUN时，只有带GETEVENTS进入内核才会把挂起的完成事件写入完成队列
+            int ret;
+            if (ready || timeout == 0)
+                ret = Enter(submit, 0, IORING_ENTER_GETEVENTS);
+            else if (timeout < 0)
+                ret = Enter(submit, 1, IORING_ENTER_GETEVENTS);
+            else
+                ret = EnterTimeout(submit, timeout);
+            if (ret < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN && errno != ETIME)
+            {
+                ERR_LOG("IO_URING ENTER ERROR:%s\n", strerror(errno));
+                abort(); // 退出程序
+            }
+        }
+        Reap(active);
+    }
+    size_t PendingCompletions() { return _completions.size(); }
+    void HandleCompletions()
+    {
+        for (size_t i = 0; i < _completions.size(); i++)
+        {
+            const Completion &c = _completions[i];
+            if (DataOp(c.user_data) == OP_RECV)
+                DispatchRecv(c);
+            else
+                DispatchAccept(c);
+        }
+        _completions.clear();
+        PublishBuffers();
+        for (size_t i = 0; i < _rearm.size(); i++)
+        {
+            Sync(_rearm[i]);
+        }
+        _rearm.clear();
+    }
+};
+
 // 在 Channel 类定义时，Poller 类仅进行了前向声明，编译器仅知晓 Poller 是一个类，并不清楚其具体定义。
 // 当在 Channel 类内部定义 Remove() 和 Update() 函数时，
 // 代码里调用了 Poller 类的成员函数 RemoveEvent() 和 UpdateEvent()，
@@ -209,129 +866,247 @@ public:
 // 所以说，poller以及channel就不放在两个头文件了，放在一起就可以了
 
 #include <sys/timerfd.h>
+#include <time.h>
 
 using TaskFunc = std::function<void()>;
-using ReleaseFunc = std::function<void()>;
+// 侵入式的定时器结点：直接挂在时间轮的格子里，刷新时只修改_expire，不需要任何内存分配和引用计数
 class TimerTask
 {
 private:
-    uint64_t _id;         // 定时器任务对象ID
-    uint32_t _timeout;    // 定时任务的超时时间
-    bool _canceled;       // false-表示没有被取消， true-表示被取消
-    TaskFunc _task_cb;    // 定时器对象要执行的定时任务
-    ReleaseFunc _release; // 用于删除TimerWheel中保存的定时器对象信息
+    friend class TimerWheel;
+    uint64_t _id;      // 定时器任务对象ID
+    uint32_t _timeout; // 定时任务的超时时间（毫秒）
+    uint64_t _expire;  // 当前的到期时间（毫秒），刷新只修改它，格子到期时再检查
+    TaskFunc _task_cb; // 定时器对象要执行的定时任务
+    TimerTask **_slot; // 所在格子的链表头
+    TimerTask *_prev;
+    TimerTask *_next;
+
 public:
-    // uint64_t _id--定时器任务对象ID; uint32_t _timeout--定时任务的超时时间
+    // uint64_t _id--定时器任务对象ID; uint32_t _timeout--定时任务的超时时间（毫秒）
     TimerTask(uint64_t id, uint32_t delay, const TaskFunc &cb) : _id(id),
                                                                  _timeout(delay),
+                                                                 _expire(0),
                                                                  _task_cb(cb),
-                                                                 _canceled(false) {}
-    ~TimerTask()
-    {
-        if (_canceled == false)
-            _task_cb();
-        _release();
-    }
-    void Cancel() { _canceled = true; }
-    void SetRelease(const ReleaseFunc &cb) { _release = cb; }
+                                                                 _slot(NULL),
+                                                                 _prev(NULL),
+                                                                 _next(NULL) {}
     uint32_t DelayTime() { return _timeout; }
 };
 
+/*分层时间轮：最底层每格1毫秒，往上每一层的一格等于下一层转一圈
+ * 第0层256格(256ms)，第1~3层各64格，总跨度2^26毫秒，约18.6小时，超过的按最大值放入，到期后重新计算位置。
+ * 高层的格子走到时，把里面的任务按剩余时间重新放到低层（降级），最终在第0层到期。
+ * 刷新定时任务只是把_expire往后推，任务还留在原来的格子里，格子走到时发现还没到期就按新的时间重新放入（惰性检查）。
+ * timerfd只设置为最近一个需要处理的格子的时间，没有定时任务时不会产生任何唤醒。
+ * 也可以不使用timerfd（内联模式）：由EventLoop根据NextTimeout()计算事件监控的超时时间，返回后调用RunExpired()，
+ * 省去了timerfd_settime和read两次系统调用，以及一次额外的唤醒。*/
+#define TIMER_LEVELS 4
+#define TIMER_LEVEL0_BITS 8
+#define TIMER_LEVEL_BITS 6
+#define TIMER_MAX_SPAN (1ULL << (TIMER_LEVEL0_BITS + TIMER_LEVEL_BITS * (TIMER_LEVELS - 1)))
+#define TIMER_NEVER UINT64_MAX
 class TimerWheel
 {
 private:
-    using WeakTask = std::weak_ptr<TimerTask>;
-    using PtrTask = std::shared_ptr<TimerTask>;
+    using Slot = TimerTask *; // 每个格子是一个侵入式双向链表
 
-    int _tick;     // 当前的秒针，走到哪里释放哪里，释放哪里，就相当于执行哪里的任务
-    int _capacity; // 表盘最大数量---其实就是最大延迟时间
-    std::vector<std::vector<PtrTask>> _wheel;
-    std::unordered_map<uint64_t, WeakTask> _timers;
+    uint64_t _current; // 已经处理到的时间（毫秒），走到哪里释放哪里，释放哪里，就相当于执行哪里的任务
+    uint64_t _armed;   // timerfd当前设置的到期时间（内联模式下是下一次需要处理的时间）
+    bool _inline;      // 内联模式：不使用timerfd，由EventLoop在Start中推进时间轮
+    size_t _count;     // 轮子中的定时任务个数
+    std::vector<Slot> _wheel[TIMER_LEVELS];
+    std::unordered_map<uint64_t, TimerTask *> _timers;
 
     EventLoop *_loop;
+    LoopHeartbeat *_heartbeat; // EventLoop的心跳，开启看门狗之后才有
+    int _timerfd; // 定时器描述符--可读事件回调就是推进时间轮，执行到期的定时任务
+    // 必须声明在_timerfd之后：成员按声明顺序初始化，否则Channel拿到的是未初始化的描述符
     std::unique_ptr<Channel> _timer_channel;
 
-    int _timerfd; // 定时器描述符--可读事件回调就是读取计数器，执行定时任务
-
 private:
-    void RemoveTimer(uint64_t id)
+    static int Shift(int level) { return level == 0 ? 0 : TIMER_LEVEL0_BITS + TIMER_LEVEL_BITS * (level - 1); }
+    static uint64_t Mask(int level) { return level == 0 ? (1 << TIMER_LEVEL0_BITS) - 1 : (1 << TIMER_LEVEL_BITS) - 1; }
+    static uint64_t NowMs()
     {
-        auto it = _timers.find(id);
-        if (it != _timers.end())
-        {
-            _timers.erase(it);
-        }
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
     }
     static int CreateTimerfd()
     {
-        int timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
+        int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
         if (timerfd < 0)
         {
             ERR_LOG("TIMERFD CREATE FAILED!");
             abort();
         }
-
-        // int timerfd_settime(int fd, int flags, struct itimerspec *new, struct itimerspec *old);
-        struct itimerspec itime;
-        itime.it_value.tv_sec = 1;
-        itime.it_value.tv_nsec = 0; // 第一次超时时间为1s后
-        itime.it_interval.tv_sec = 1;
-        itime.it_interval.tv_nsec = 0; // 第一次超时后，每次超时的间隔时
-
-        timerfd_settime(timerfd, 0, &itime, NULL);
+        // 创建时不设置超时时间，有定时任务时才按最近的到期时间设置
         return timerfd;
     }
-
-    // 读取到数据times---从上一次read之后超时的次数
-    int ReadTimefd()
+    // 读取timerfd的超时次数，只是为了清除可读事件，实际到期多少由时间轮自己根据当前时间计算
+    void ReadTimefd()
     {
         uint64_t times;
-        // 有可能因为其他描述符的事件处理花费事件比较长，然后在处理定时器描述符事件的时候，有可能就已经超时了很多次
-        // read读取到的数据times就是从上一次read之后超时的次数
         int ret = read(_timerfd, &times, 8);
-        if (ret < 0)
+        if (ret < 0 && errno != EAGAIN && errno != EINTR)
         {
             ERR_LOG("READ TIMEFD FAILED!");
             abort();
         }
-        return times;
     }
-    // 这个函数应该每秒钟被执行一次，相当于秒针向后走了一步
-    void RunTimerTask()
+    // 把timerfd设置为在绝对时间when（毫秒）超时，TIMER_NEVER表示停止
+    void ArmTimerfd(uint64_t when)
     {
-        _tick = (_tick + 1) % _capacity;
-        _wheel[_tick].clear(); // 清空指定位置的数组，就会把数组中保存的所有管理定时器对象的shared_ptr释放掉
+        if (when == _armed)
+            return;
+        _armed = when;
+        if (_inline)
+            return; // 内联模式只需要记录下来，EventLoop据此计算超时时间
+        struct itimerspec itime;
+        memset(&itime, 0, sizeof(itime));
+        if (when != TIMER_NEVER)
+        {
+            itime.it_value.tv_sec = when / 1000;
+            itime.it_value.tv_nsec = (when % 1000) * 1000000;
+        }
+        timerfd_settime(_timerfd, TFD_TIMER_ABSTIME, &itime, NULL);
     }
-
-    // 根据实际超时的次数，执行对应的超时任务
-    void OnTime()
+    // 按_expire放入对应层的格子，返回这个格子会被处理的时间
+    uint64_t Insert(TimerTask *task)
+    {
+        uint64_t expire = task->_expire > _current ? task->_expire : _current;
+        if (expire - _current >= TIMER_MAX_SPAN)
+            expire = _current + TIMER_MAX_SPAN - 1; // 超出跨度的先放在最高层，到时再重新计算
+        uint64_t diff = expire - _current;
+        int level = 0;
+        while (level < TIMER_LEVELS - 1 && diff >= (1ULL << Shift(level + 1)))
+            level++;
+        Slot *slot = &_wheel[level][(expire >> Shift(level)) & Mask(level)];
+        task->_slot = slot;
+        task->_prev = NULL;
+        task->_next = *slot;
+        if (*slot)
+            (*slot)->_prev = task;
+        *slot = task;
+        _count++;
+        return (expire >> Shift(level)) << Shift(level);
+    }
+    void Unlink(TimerTask *task)
+    {
+        if (task->_prev)
+            task->_prev->_next = task->_next;
+        else
+            *task->_slot = task->_next;
+        if (task->_next)
+            task->_next->_prev = task->_prev;
+        task->_slot = NULL;
+        _count--;
+    }
+    // 最近一个需要处理（执行或降级）的格子的时间
+    uint64_t NextEvent()
     {
-        int times = ReadTimefd();
-        for (int i = 0; i < times; i++)
+        if (_count == 0)
+            return TIMER_NEVER;
+        uint64_t next = TIMER_NEVER;
+        for (int level = 0; level < TIMER_LEVELS; level++)
         {
-            RunTimerTask();
+            uint64_t idx = _current >> Shift(level);
+            uint64_t slots = Mask(level) + 1;
+            for (uint64_t j = 1; j <= slots; j++)
+            {
+                if (_wheel[level][(idx + j) & Mask(level)] != NULL)
+                {
+                    uint64_t when = (idx + j) << Shift(level);
+                    next = when < next ? when : next;
+                    break;
+                }
+            }
+        }
+        return next;
+    }
+    // 执行一个到期的定时任务；先从管理中移除，任务中再添加/取消定时器都不会受影响
+    void Expire(TimerTask *task)
+    {
+        _timers.erase(task->_id);
+        std::unique_ptr<TimerTask> holder(task);
+        LoopBeat beat(_heartbeat, BEAT_TIMER, -1, 0, task->_id, _heartbeat ? task->_task_cb.target_type().name() : NULL);
+        task->_task_cb();
+    }
+    // 处理时间点tick：先把走到的高层格子降级，再处理第0层对应格子
+    // 每次都从格子头部取，任务执行过程中取消了同一格子中的其他任务也是安全的
+    void RunTick(uint64_t tick)
+    {
+        _current = tick;
+        for (int level = TIMER_LEVELS - 1; level > 0; level--)
+        {
+            if ((tick & ((1ULL << Shift(level)) - 1)) != 0)
+                continue;
+            Slot *slot = &_wheel[level][(tick >> Shift(level)) & Mask(level)];
+            while (*slot)
+            {
+                TimerTask *task = *slot;
+                Unlink(task);
+                Insert(task);
+            }
         }
+        Slot *slot = &_wheel[0][tick & Mask(0)];
+        while (*slot)
+        {
+            TimerTask *task = *slot;
+            Unlink(task);
+            if (task->_expire > tick)
+                Insert(task); // 被刷新过，或者超出跨度被提前放入的，按新的时间重新放入
+            else
+                Expire(task);
+        }
+    }
+    // 把时间轮推进到now
+    void Advance(uint64_t now)
+    {
+        while (_current < now)
+        {
+            uint64_t next = NextEvent();
+            if (next > now)
+            {
+                _current = now; // 中间没有需要处理的格子，直接跳过去
+                break;
+            }
+            RunTick(next);
+        }
+    }
+    void OnTime()
+    {
+        ReadTimefd();
+        _armed = TIMER_NEVER; // 已经超时了，需要重新设置
+        Advance(NowMs());
+        ArmTimerfd(NextEvent());
     }
     void TimerAddInLoop(uint64_t id, uint32_t delay, const TaskFunc &cb)
     {
-        PtrTask pt(new TimerTask(id, delay, cb));
-        pt->SetRelease(std::bind(&TimerWheel::RemoveTimer, this, id));
-        int pos = (_tick + delay) % _capacity;
-        _wheel[pos].push_back(pt);
-        _timers[id] = WeakTask(pt);
+        // 同一个ID重复添加，用新的替换旧的
+        TimerCancelInLoop(id);
+        if (_count == 0)
+            _current = NowMs(); // 轮子是空的，可以直接把时间对齐到现在
+        TimerTask *task = new TimerTask(id, delay, cb);
+        task->_expire = NowMs() + delay + 1; // 当前时间向上取整到毫秒，保证不会提前到期
+        if (task->_expire <= _current)
+            task->_expire = _current + 1; // _current对应的格子已经处理过了
+        uint64_t when = Insert(task);
+        if (when < _armed)
+            ArmTimerfd(when);
+        _timers[id] = task;
     }
     void TimerRefreshInLoop(uint64_t id)
     {
-        // 通过保存的定时器对象的weak_ptr构造一个shared_ptr出来，添加到轮子中
+        // 只把到期时间往后推，任务不用移动，等它所在的格子走到时再重新放入
         auto it = _timers.find(id);
         if (it == _timers.end())
         {
             return; // 没找着定时任务，没法刷新，没法延迟
         }
-        PtrTask pt = it->second.lock(); // lock获取weak_ptr管理的对象对应的shared_ptr
-        int delay = pt->DelayTime();
-        int pos = (_tick + delay) % _capacity;
-        _wheel[pos].push_back(pt);
+        TimerTask *task = it->second;
+        task->_expire = NowMs() + task->_timeout + 1;
     }
     void TimerCancelInLoop(uint64_t id)
     {
@@ -340,20 +1115,71 @@ private:
         {
             return; // 没找着定时任务，没法刷新，没法延迟
         }
-        PtrTask pt = it->second.lock();
-        if (pt)
-            pt->Cancel();
+        TimerTask *task = it->second;
+        _timers.erase(it);
+        Unlink(task);
+        delete task;
     }
 
 public:
-    TimerWheel(EventLoop *loop) : _capacity(60), _tick(0), _wheel(_capacity), _loop(loop),
-                                  _timerfd(CreateTimerfd()), _timer_channel(new Channel(_loop, _timerfd))
+    TimerWheel(EventLoop *loop) : _current(NowMs()), _armed(TIMER_NEVER), _inline(false), _count(0), _loop(loop),
+                                  _heartbeat(NULL), _timerfd(CreateTimerfd()), _timer_channel(new Channel(_loop, _timerfd))
     {
+        for (int level = 0; level < TIMER_LEVELS; level++)
+        {
+            _wheel[level].resize(Mask(level) + 1, NULL);
+        }
         _timer_channel->SetReadCallback(std::bind(&TimerWheel::OnTime, this));
         _timer_channel->EnableRead(); // 启动读事件监控
     }
+    ~TimerWheel()
+    {
+        for (auto &it : _timers)
+        {
+            delete it.second;
+        }
+        if (_timerfd >= 0)
+            close(_timerfd);
+    }
+    void SetHeartbeat(LoopHeartbeat *heartbeat) { _heartbeat = heartbeat; }
+    // 切换为内联模式：移除timerfd的监控并关闭它，之后由EventLoop调用NextTimeout/RunExpired，只能在EventLoop线程中调用
+    void EnableInline()
+    {
+        if (_inline)
+            return;
+        _timer_channel->Remove(); // timerfd即使已经设置过，超时了也不会再被处理
+        _timer_channel.reset();
+        close(_timerfd); // 内联模式不再需要timerfd，每个EventLoop省下一个描述符
+        _timerfd = -1;
+        _inline = true;
+    }
+    bool Inline() { return _inline; }
+    // 距离下一次需要处理时间轮的毫秒数，-1表示没有定时任务，可以直接作为事件监控的超时时间
+    int NextTimeout()
+    {
+        if (_armed == TIMER_NEVER)
+            return -1;
+        uint64_t now = NowMs();
+        if (_armed <= now)
+            return 0;
+        uint64_t timeout = _armed - now;
+        return timeout > INT32_MAX ? INT32_MAX : (int)timeout;
+    }
+    // 内联模式下，事件监控返回后调用：执行所有已经到期的定时任务
+    void RunExpired()
+    {
+        if (_armed == TIMER_NEVER)
+            return;
+        uint64_t now = NowMs();
+        if (now < _armed)
+            return;
+        _armed = TIMER_NEVER;
+        Advance(now);
+        ArmTimerfd(NextEvent());
+    }
     /*定时器中有个_timers成员，定时器信息的操作有可能在多线程中进行，因此需要考虑线程安全问题*/
     /*如果不想加锁，那就把对定期的所有操作，都放到一个线程中进行*/
+    // delay的单位是毫秒
     void TimerAdd(uint64_t id, uint32_t delay, const TaskFunc &cb);
     // 刷新/延迟定时任务
     void TimerRefresh(uint64_t id);
@@ -371,8 +1197,66 @@ public:
 };
 
 #include <thread>
-#include <mutex>
 #include <sys/eventfd.h>
+#include "TaskQueue.hpp"
+#include "SpscRing.hpp"
+#include <deque>
+#include "Histogram.hpp"
+#include <chrono>
+// 忙轮询的统计信息，单位为微秒
+struct LoopPollStats
+{
+    uint64_t spin_us;   // 忙轮询花费的时间
+    uint64_t block_us;  // 阻塞在事件监控中的时间
+    uint64_t spin_hits; // 忙轮询期间等到了事件/任务的次数
+    uint64_t blocks;    // 进入阻塞的次数
+};
+
+// RunAfter/RunEvery/RunAt返回的句柄，可以在任意线程中通过EventLoop::Cancel取消
+class TimerHandle
+{
+private:
+    friend class EventLoop;
+    struct State
+    {
+        std::atomic<bool> canceled; // 取消标志：取消请求还没送到EventLoop线程时，到期也不会执行
+        uint64_t id;                // 在时间轮中的ID
+        uint64_t next;              // 下一次到期的时间（毫秒）
+        uint32_t interval;          // 重复执行的间隔（毫秒），0表示只执行一次
+        TaskFunc cb;
+    };
+    std::shared_ptr<State> _state;
+
+public:
+    bool Valid() const { return (bool)_state; }
+};
+
+// 每一轮事件循环的统计，时间单位为纳秒
+struct LoopStats
+{
+    Histogram poll_ns;       // 阻塞在事件监控（包括忙轮询）中的时间
+    Histogram callback_ns;   // 执行就绪事件回调（以及到期定时任务）的时间
+    Histogram task_ns;       // 执行任务池的时间
+    Histogram active_events; // 每一轮的就绪事件个数
+    Histogram task_depth;    // 每一轮执行的任务个数，即任务池的积压
+};
+struct LoopStatsSnapshot
+{
+    HistogramSnapshot poll_ns;
+    HistogramSnapshot callback_ns;
+    HistogramSnapshot task_ns;
+    HistogramSnapshot active_events;
+    HistogramSnapshot task_depth;
+    void Merge(const LoopStatsSnapshot &other)
+    {
+        poll_ns.Merge(other.poll_ns);
+        callback_ns.Merge(other.callback_ns);
+        task_ns.Merge(other.task_ns);
+        active_events.Merge(other.active_events);
+        task_depth.Merge(other.task_depth);
+    }
+};
+
 class EventLoop
 {
 private:
@@ -380,24 +1264,67 @@ private:
     std::thread::id _thread_id; // 线程ID
     int _event_fd;              // eventfd唤醒IO事件监控有可能导致的阻塞
     std::unique_ptr<Channel> _event_channel;
-    Poller _poller;              // 进行所有描述符的事件监控
-    std::vector<Functor> _tasks; // 任务池
-    std::mutex _mutex;           // 实现任务池操作的线程安全
+    std::unique_ptr<Poller> _poller; // 进行所有描述符的事件监控
+    // 修改了监控事件、还没有提交给内核的Channel；定时器模块构造时就会用到，必须声明在它之前
+    std::vector<Channel *> _dirty_channels;
+    /*EventLoop之间的单生产者单消费者队列网格，由LoopThreadPool建立，SendTo使用*/
+    int _mesh_index;                      // 在网格中的编号，-1表示不在网格中
+    std::vector<EventLoop *> _mesh_loops; // 网格中所有的EventLoop，按编号
+    std::vector<SpscRing *> _mesh_out;    // 发往第i个EventLoop的队列，发给自己的位置为NULL
+    std::vector<SpscRing *> _mesh_in;     // 其他EventLoop发给自己的队列
+    std::vector<int> _doorbells;          // 本轮写入过、还没有唤醒的目标编号，事件监控之前统一唤醒
+    std::vector<bool> _doorbell_marks;    // 目标编号是否已经在_doorbells中
+    /*队列满时放不下的任务按顺序暂存在这里，之后发往同一个目标的任务也排在后面，唤醒之前再搬进队列，保证先后顺序*/
+    std::vector<std::deque<Functor>> _mesh_overflow;
+    size_t _overflow_count; // 所有暂存的任务数
+    // RunAfter/RunEvery/RunAt使用的定时器ID，从最高位开始分配，不会和使用连接ID的非活跃销毁定时器冲突
+    std::atomic<uint64_t> _next_timer_id;
+    TaskQueue _tasks;                // 任务池，无锁的多生产者单消费者队列
+    /*eventfd唤醒的去重：只有EventLoop阻塞在Poll中时才需要唤醒，且已经有人唤醒过了就不必重复唤醒*/
+    std::atomic<bool> _polling;        // 是否正阻塞在Poll中（或者即将进入）
+    std::atomic<bool> _wakeup_pending; // 是否已经写过eventfd，还没被读取
     TimerWheel _timer_wheel;     // 定时器模块
+    /*忙轮询：阻塞之前先用0超时的Poll空转一段时间，减少被唤醒的延迟，适合独占CPU核心的场景
+     * 空转没等到任何东西，下一次空转的时间就减半；阻塞后很快又被唤醒（空转本可以等到），就恢复*/
+    uint32_t _busy_poll_us;    // 配置的空转时间，0表示不使用忙轮询
+    uint32_t _spin_budget_us;  // 下一次允许空转的时间
+    std::atomic<uint64_t> _spin_us;
+    std::atomic<uint64_t> _block_us;
+    std::atomic<uint64_t> _spin_hits;
+    std::atomic<uint64_t> _blocks;
+    std::unique_ptr<LoopStats> _stats; // 事件循环的直方图统计，开启之后才分配
+    std::unique_ptr<LoopHeartbeat> _heartbeat; // 看门狗检查的心跳，开启之后才分配
+    std::vector<Channel *> _actives;           // 每一轮的就绪Channel，复用同一块内存，稳定之后事件循环不再分配
 public:
-    // 执行任务池中的所有任务
-    void RunAllTask()
+    // 执行任务池中的所有任务，返回执行的任务个数
+    size_t RunAllTask()
     {
-        std::vector<Functor> functor;
+        size_t count = _tasks.RunAll(_heartbeat.get());
+        for (auto &ring : _mesh_in)
         {
-            std::unique_lock<std::mutex> _lock(_mutex);
-            _tasks.swap(functor);
+            count += ring->RunAll(_heartbeat.get());
         }
-        for (auto &f : functor)
+        return count;
+    }
+    static Poller *CreatePoller(PollerType type)
+    {
+        if (type == POLLER_URING)
         {
-            f();
+            UringPoller *poller = new UringPoller();
+            if (poller->Usable())
+            {
+                return poller;
+            }
+            ERR_LOG("IO_URING UNAVAILABLE, FALLBACK TO EPOLL!");
+            delete poller;
         }
-        return;
+        return new EpollPoller();
+    }
+    // 当前线程的EventLoop，每个线程最多一个
+    static EventLoop *&ThreadLoop()
+    {
+        static thread_local EventLoop *loop = NULL;
+        return loop;
     }
     static int CreateEventFd()
     {
@@ -411,6 +1338,8 @@ public:
     }
     void ReadEventfd()
     {
+        // 先清除标记再读：之后入队的任务如果发现EventLoop又要阻塞了，会重新唤醒
+        _wakeup_pending.store(false);
         uint64_t res = 0;
         int ret = read(_event_fd, &res, sizeof(res));
         if (ret < 0)
@@ -425,6 +1354,163 @@ public:
         }
         return;
     }
+    static uint64_t NowNs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+    static uint64_t NowUs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+    TimerHandle AddTimer(uint32_t delay, uint32_t interval, const TaskFunc &cb)
+    {
+        TimerHandle handle;
+        std::shared_ptr<TimerHandle::State> state = std::make_shared<TimerHandle::State>();
+        state->canceled.store(false);
+        state->id = _next_timer_id.fetch_add(1, std::memory_order_relaxed);
+        state->next = NowUs() / 1000 + delay;
+        state->interval = interval;
+        state->cb = cb;
+        handle._state = state;
+        _timer_wheel.TimerAdd(state->id, delay, [this, state]()
+                              { OnTimer(state); });
+        return handle;
+    }
+    void OnTimer(const std::shared_ptr<TimerHandle::State> &state)
+    {
+        if (state->canceled.load())
+            return;
+        {
+            // 看门狗报告使用者的回调，而不是包装它的lambda
+            LoopHeartbeat *heartbeat = _heartbeat.get();
+            LoopBeat beat(heartbeat, BEAT_TIMER, -1, 0, state->id, heartbeat ? state->cb.target_type().name() : NULL);
+            state->cb();
+        }
+        if (state->interval == 0 || state->canceled.load())
+            return;
+        // 下一次到期的时间按固定节奏推进，落后太多（回调或者EventLoop太慢）就跳过错过的周期
+        uint64_t now = NowUs() / 1000;
+        state->next += state->interval;
+        if (state->next <= now)
+            state->next = now + state->interval - (now - state->next) % state->interval;
+        _timer_wheel.TimerAdd(state->id, state->next - now, [this, state]()
+                              { OnTimer(state); });
+    }
+    // 任务池或者其他EventLoop发来的队列中是否有任务
+    bool HasPendingTasks()
+    {
+        if (!_tasks.Empty())
+            return true;
+        for (auto &ring : _mesh_in)
+        {
+            if (!ring->Empty())
+                return true;
+        }
+        return false;
+    }
+    // 如果EventLoop阻塞在事件监控中（或者即将阻塞），并且还没有人唤醒过，就写eventfd唤醒它
+    void Notify()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_polling.load(std::memory_order_relaxed) && _wakeup_pending.exchange(true) == false)
+        {
+            WeakUpEventFd();
+        }
+    }
+    // 本轮通过SendTo发送过任务的目标EventLoop，每个最多唤醒一次；
+    // 先把暂存的任务尽量搬进队列，还有搬不完的就留着目标编号，下一轮接着搬
+    void FlushDoorbells()
+    {
+        size_t keep = 0;
+        for (size_t i = 0; i < _doorbells.size(); i++)
+        {
+            int idx = _doorbells[i];
+            std::deque<Functor> &overflow = _mesh_overflow[idx];
+            while (!overflow.empty() && _mesh_out[idx]->Push(overflow.front()))
+            {
+                overflow.pop_front();
+                _overflow_count--;
+            }
+            _mesh_loops[idx]->Notify();
+            if (overflow.empty())
+                _doorbell_marks[idx] = false;
+            else
+                _doorbells[keep++] = idx;
+        }
+        _doorbells.resize(keep);
+    }
+    // 事件监控的超时时间：有任务就不阻塞，内联定时器最多阻塞到下一个定时任务到期
+    int PollTimeout()
+    {
+        if (HasPendingTasks())
+            return 0;
+        if (_overflow_count > 0)
+            return 1; // 还有暂存的任务等着目标EventLoop腾出队列，不能一直阻塞
+        if (_timer_wheel.Inline())
+            return _timer_wheel.NextTimeout();
+        return -1;
+    }
+    // 空转等待事件或任务，等到了返回true
+    bool BusyPoll(std::vector<Channel *> *actives)
+    {
+        if (_spin_budget_us == 0)
+            return false;
+        int timeout = PollTimeout();
+        if (timeout == 0)
+            return false; // 本来就不会阻塞
+        uint64_t start = NowUs(), now;
+        uint64_t deadline = start + _spin_budget_us;
+        if (timeout > 0 && start + (uint64_t)timeout * 1000 < deadline)
+            deadline = start + (uint64_t)timeout * 1000; // 不能耽误定时任务
+        bool hit = false;
+        do
+        {
+            _poller->Poll(actives, 0);
+            hit = !actives->empty() || _poller->PendingCompletions() > 0 || HasPendingTasks();
+            now = NowUs();
+        } while (hit == false && now < deadline);
+        _spin_us.fetch_add(now - start, std::memory_order_relaxed);
+        if (hit)
+        {
+            _spin_hits.fetch_add(1, std::memory_order_relaxed);
+            _spin_budget_us = _busy_poll_us;
+            return true;
+        }
+        _spin_budget_us >>= 1;
+        return false;
+    }
+    // 1. 事件监控，
+    //    先声明自己要阻塞了，再检查任务池：和QueueInLoop中先入队、再检查_polling的顺序配合，
+    //    保证要么这里看到了新任务不阻塞，要么入队的线程看到_polling去唤醒
+    void Wait(std::vector<Channel *> *actives)
+    {
+        FlushEvents();
+        FlushDoorbells();
+        if (_busy_poll_us == 0)
+        {
+            _polling.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            _poller->Poll(actives, PollTimeout());
+            _polling.store(false, std::memory_order_relaxed);
+            return;
+        }
+        if (BusyPoll(actives))
+            return;
+        uint64_t start = NowUs();
+        _polling.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        _poller->Poll(actives, PollTimeout());
+        _polling.store(false, std::memory_order_relaxed);
+        uint64_t blocked = NowUs() - start;
+        _block_us.fetch_add(blocked, std::memory_order_relaxed);
+        _blocks.fetch_add(1, std::memory_order_relaxed);
+        if (blocked < _busy_poll_us)
+            _spin_budget_us = _busy_poll_us; // 空转就能等到，说明又忙起来了
+    }
     void WeakUpEventFd()
     {
         uint64_t val = 1;
@@ -442,31 +1528,69 @@ public:
     }
 
 public:
-    EventLoop() : _thread_id(std::this_thread::get_id()),
-                  _event_fd(CreateEventFd()),
-                  _event_channel(new Channel(this, _event_fd)),
-                  _timer_wheel(this)
+    EventLoop(PollerType type = POLLER_EPOLL) : _thread_id(std::this_thread::get_id()),
+                                                _event_fd(CreateEventFd()),
+                                                _event_channel(new Channel(this, _event_fd)),
+                                                _poller(CreatePoller(type)),
+                                                _mesh_index(-1),
+                                                _overflow_count(0),
+                                                _next_timer_id(1ULL << 63),
+                                                _polling(false),
+                                                _wakeup_pending(false),
+                                                _timer_wheel(this),
+                                                _busy_poll_us(0),
+                                                _spin_budget_us(0),
+                                                _spin_us(0),
+                                                _block_us(0),
+                                                _spin_hits(0),
+                                                _blocks(0)
     {
         // 给eventfd添加可读事件回调函数，读取eventfd事件通知次数
         _event_channel->SetReadCallback(std::bind(&EventLoop::ReadEventfd, this));
         // 启动eventfd的读事件监控
         _event_channel->EnableRead();
+        ThreadLoop() = this;
+    }
+    ~EventLoop()
+    {
+        if (ThreadLoop() == this)
+            ThreadLoop() = NULL;
     }
+    // 调用线程所属的EventLoop（在该线程中构造的），不是EventLoop线程返回NULL
+    static EventLoop *Current() { return ThreadLoop(); }
     // 三步走--事件监控-》就绪事件处理-》执行任务
     void Start()
     {
         while (1)
         {
-            // 1. 事件监控，
-            std::vector<Channel *> actives;
-            _poller.Poll(&actives);
+            LoopStats *stats = _stats.get();
+            // 1. 事件监控
+            _actives.clear();
+            uint64_t start = stats ? NowNs() : 0;
+            Wait(&_actives);
+            uint64_t polled = stats ? NowNs() : 0;
+            size_t events = _actives.size() + _poller->PendingCompletions();
             // 2. 事件处理。
-            for (auto &channel : actives)
+            for (auto &channel : _actives)
             {
                 channel->HandleEvent();
             }
+            _poller->HandleCompletions();
+            if (_timer_wheel.Inline())
+            {
+                _timer_wheel.RunExpired();
+            }
+            uint64_t handled = stats ? NowNs() : 0;
             // 3. 执行任务
-            RunAllTask();
+            size_t tasks = RunAllTask();
+            if (stats)
+            {
+                stats->poll_ns.Record(polled - start);
+                stats->callback_ns.Record(handled - polled);
+                stats->task_ns.Record(NowNs() - handled);
+                stats->active_events.Record(events);
+                stats->task_depth.Record(tasks);
+            }
         }
     }
     // 用于判断当前线程是否是EventLoop对应的线程；
@@ -490,22 +1614,168 @@ public:
     // 将操作压入任务池
     void QueueInLoop(const Functor &cb)
     {
+        _tasks.Push(cb);
+        // EventLoop线程自己压入的任务，本轮结束前就会检查到，不需要唤醒
+        if (IsInLoop())
         {
-            std::unique_lock<std::mutex> _lock(_mutex);
-            _tasks.push_back(cb);
+            return;
         }
         // 唤醒有可能因为没有事件就绪，而导致的epoll阻塞；
         // 其实就是给eventfd写入一个数据，eventfd就会触发可读事件
-        WeakUpEventFd();
+        // EventLoop没有阻塞（正在处理事件/任务，之后一定会执行RunAllTask），或者已经有人唤醒过了，都不必再写
+        Notify();
     }
-    // 添加/修改描述符的事件监控
-    void UpdateEvent(Channel *channel) { return _poller.UpdateEvent(channel); }
-    // 移除描述符的监控
-    void RemoveEvent(Channel *channel) { return _poller.RemoveEvent(channel); }
+    /*把任务交给dst执行：网格中的两个EventLoop之间通过单生产者单消费者队列直接传递，
+     * 本轮中发给同一个EventLoop的所有任务只在事件监控之前唤醒一次。
+     * 队列满了就按顺序暂存在本地，之后的任务也排在后面，保证同一个EventLoop发出的任务按发送顺序执行。
+     * 不在网格中或者不是在本EventLoop线程中调用，就退回到dst->QueueInLoop*/
+    void SendTo(EventLoop *dst, const Functor &task)
+    {
+        if (dst == this)
+            return QueueInLoop(task);
+        // 先确认在本线程：_mesh_out只在本线程中安装，dst的编号在安装之前就已经设置好了
+        if (!IsInLoop() || _mesh_out.empty() || dst->_mesh_index < 0)
+            return dst->QueueInLoop(task);
+        int idx = dst->_mesh_index;
+        if (!_mesh_overflow[idx].empty() || _mesh_out[idx]->Push(task) == false)
+        {
+            _mesh_overflow[idx].push_back(task);
+            _overflow_count++;
+        }
+        if (_doorbell_marks[idx] == false)
+        {
+            _doorbell_marks[idx] = true;
+            _doorbells.push_back(idx);
+        }
+    }
+    // 由LoopThreadPool在建立网格时调用：先为所有EventLoop设置编号，再到各自的线程中安装队列
+    void SetMeshIndex(int idx) { _mesh_index = idx; }
+    void InstallMesh(const std::vector<EventLoop *> &loops, const std::vector<SpscRing *> &out,
+                     const std::vector<SpscRing *> &in)
+    {
+        AssertInLoop();
+        _mesh_loops = loops;
+        _mesh_out = out;
+        _mesh_in = in;
+        _doorbell_marks.assign(loops.size(), false);
+        _mesh_overflow.resize(loops.size());
+    }
+    // 添加/修改描述符的事件监控：只是记录下来，下一次事件监控之前统一提交
+    void UpdateEvent(Channel *channel)
+    {
+        if (channel->Dirty())
+            return;
+        channel->SetDirty(true);
+        _dirty_channels.push_back(channel);
+    }
+    // 移除描述符的监控，立即生效：之后描述符就会被关闭，Channel也可能被释放
+    void RemoveEvent(Channel *channel)
+    {
+        if (channel->Dirty())
+        {
+            channel->SetDirty(false);
+            _dirty_channels.erase(std::find(_dirty_channels.begin(), _dirty_channels.end(), channel));
+        }
+        channel->SetKernelEvents(CHANNEL_UNSYNCED);
+        return _poller->RemoveEvent(channel);
+    }
+    // 把这一轮修改过的监控事件提交给内核，和内核中一致的直接跳过，每个描述符最多一次系统调用
+    void FlushEvents()
+    {
+        for (auto &channel : _dirty_channels)
+        {
+            channel->SetDirty(false);
+            if (channel->Events() == channel->KernelEvents())
+                continue;
+            _poller->UpdateEvent(channel);
+            channel->SetKernelEvents(channel->Events());
+        }
+        _dirty_channels.clear();
+    }
+    // 阻塞之前最多空转us微秒，0表示关闭；只能在EventLoop线程中、Start之前调用
+    void SetBusyPoll(uint32_t us)
+    {
+        _busy_poll_us = us;
+        _spin_budget_us = us;
+    }
+    // 开启事件循环的直方图统计；只能在EventLoop线程中、Start之前调用
+    void EnableStats()
+    {
+        if (!_stats)
+            _stats.reset(new LoopStats());
+    }
+    // 开启心跳：每个事件回调、定时任务、任务池中的任务都会记录开始时间和回调信息，交给LoopWatchdog检查
+    // 只能在EventLoop线程中、Start之前调用
+    void EnableHeartbeat()
+    {
+        if (_heartbeat)
+            return;
+        _heartbeat.reset(new LoopHeartbeat());
+        _timer_wheel.SetHeartbeat(_heartbeat.get());
+    }
+    // 没有开启心跳时返回NULL
+    LoopHeartbeat *Heartbeat() { return _heartbeat.get(); }
+    // 被看门狗发现卡住的次数，任意线程都可以调用
+    uint64_t StallCount() { return _heartbeat ? _heartbeat->stalls.load(std::memory_order_relaxed) : 0; }
+    // 事件循环统计的快照，任意线程都可以调用；没有开启时各项都是空的
+    LoopStatsSnapshot StatsSnapshot()
+    {
+        LoopStatsSnapshot snapshot;
+        LoopStats *stats = _stats.get();
+        if (stats)
+        {
+            snapshot.poll_ns = stats->poll_ns.Snapshot();
+            snapshot.callback_ns = stats->callback_ns.Snapshot();
+            snapshot.task_ns = stats->task_ns.Snapshot();
+            snapshot.active_events = stats->active_events.Snapshot();
+            snapshot.task_depth = stats->task_depth.Snapshot();
+        }
+        return snapshot;
+    }
+    // 忙轮询的统计信息，任意线程都可以调用
+    LoopPollStats PollStats()
+    {
+        LoopPollStats stats;
+        stats.spin_us = _spin_us.load(std::memory_order_relaxed);
+        stats.block_us = _block_us.load(std::memory_order_relaxed);
+        stats.spin_hits = _spin_hits.load(std::memory_order_relaxed);
+        stats.blocks = _blocks.load(std::memory_order_relaxed);
+        return stats;
+    }
+    // 不再使用timerfd，由事件监控的超时时间驱动定时器，只能在EventLoop线程中、Start之前调用
+    void EnableInlineTimer() { _timer_wheel.EnableInline(); }
+    // 添加定时任务，delay的单位是秒
     void TimerAdd(uint64_t id, uint32_t delay, const TaskFunc &cb)
+    {
+        uint64_t ms = (uint64_t)delay * 1000; // 先扩展再乘，超过时间轮的范围就取最大值，不能回绕成一个很短的时间
+        return _timer_wheel.TimerAdd(id, ms > UINT32_MAX ? UINT32_MAX : (uint32_t)ms, cb);
+    }
+    // 添加定时任务，delay的单位是毫秒
+    void TimerAddMs(uint64_t id, uint32_t delay, const TaskFunc &cb)
     {
         return _timer_wheel.TimerAdd(id, delay, cb);
     }
+    // ms毫秒之后执行一次cb，任意线程都可以调用
+    TimerHandle RunAfter(uint32_t ms, const TaskFunc &cb) { return AddTimer(ms, 0, cb); }
+    // 每隔ms毫秒（大于0）执行一次cb，按固定的节奏执行，不会因为回调的耗时累积误差
+    TimerHandle RunEvery(uint32_t ms, const TaskFunc &cb) { return AddTimer(ms, ms, cb); }
+    // 在时间点when执行一次cb，已经过去的时间点会尽快执行
+    TimerHandle RunAt(std::chrono::steady_clock::time_point when, const TaskFunc &cb)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        uint64_t ms = 0;
+        if (when > now)
+            ms = std::chrono::duration_cast<std::chrono::microseconds>(when - now).count() / 1000 + 1; // 向上取整，不会提前执行
+        return AddTimer(ms > UINT32_MAX ? UINT32_MAX : (uint32_t)ms, 0, cb);
+    }
+    // 取消RunAfter/RunEvery/RunAt添加的定时任务，任意线程都可以调用，也可以在定时任务自己的回调中调用
+    void Cancel(const TimerHandle &handle)
+    {
+        if (!handle._state)
+            return;
+        handle._state->canceled.store(true);
+        _timer_wheel.TimerCancel(handle._state->id);
+    }
     void TimerRefresh(uint64_t id) { return _timer_wheel.TimerRefresh(id); }
     void TimerCancel(uint64_t id) { return _timer_wheel.TimerCancel(id); }
     bool HasTimer(uint64_t id) { return _timer_wheel.HasTimer(id); }
@@ -513,6 +1783,7 @@ public:
 
 void Channel::Remove() { return _loop->RemoveEvent(this); }
 void Channel::Update() { return _loop->UpdateEvent(this); }
+LoopHeartbeat *Channel::Heartbeat() { return _loop->Heartbeat(); }
 
 void TimerWheel::TimerAdd(uint64_t id, uint32_t delay, const TaskFunc &cb)
 {
@@ -521,6 +1792,11 @@ void TimerWheel::TimerAdd(uint64_t id, uint32_t delay, const TaskFunc &cb)
 // 刷新/延迟定时任务
 void TimerWheel::TimerRefresh(uint64_t id)
 {
+    // 每次连接有事件都会刷新，在EventLoop线程中直接调用，避免构造std::function
+    if (_loop->IsInLoop())
+    {
+        return TimerRefreshInLoop(id);
+    }
     _loop->RunInLoop(std::bind(&TimerWheel::TimerRefreshInLoop, this, id));
 }
 void TimerWheel::TimerCancel(uint64_t id)
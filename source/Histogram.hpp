@@ -0,0 +1,134 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/*HDR风格的对数-线性直方图：每个2的幂次区间再等分为16个子桶，相对误差约6%
+ * 小于16的值精确记录，最大可记录2^48-1，超出的按最大值记录。
+ * 只能由一个线程写入（各自的EventLoop线程），计数使用原子变量，任意线程都可以随时读取快照，不需要加锁。*/
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 48
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+// 直方图在某一时刻的副本，可以合并多个线程的数据后再计算百分位
+class HistogramSnapshot
+{
+private:
+    std::vector<uint64_t> _counts;
+    uint64_t _total;
+    uint64_t _sum;
+    uint64_t _max;
+
+public:
+    HistogramSnapshot() : _counts(HISTOGRAM_BUCKETS, 0), _total(0), _sum(0), _max(0) {}
+    // 桶中能代表的最大值
+    static uint64_t BucketValue(size_t index)
+    {
+        if (index < HISTOGRAM_SUB_COUNT)
+            return index;
+        int shift = index / HISTOGRAM_SUB_COUNT - 1;
+        uint64_t base = (uint64_t)(HISTOGRAM_SUB_COUNT + index % HISTOGRAM_SUB_COUNT) << shift;
+        return base + (1ULL << shift) - 1;
+    }
+    std::vector<uint64_t> &Counts() { return _counts; }
+    void SetSummary(uint64_t total, uint64_t sum, uint64_t max)
+    {
+        _total = total;
+        _sum = sum;
+        _max = max;
+    }
+    uint64_t Count() { return _total; }
+    uint64_t Max() { return _max; }
+    double Mean() { return _total == 0 ? 0 : (double)_sum / _total; }
+    // 百分位，p取值[0, 100]
+    uint64_t Percentile(double p)
+    {
+        if (_total == 0)
+            return 0;
+        uint64_t target = (uint64_t)(p / 100 * _total + 0.5);
+        if (target == 0)
+            target = 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < _counts.size(); i++)
+        {
+            seen += _counts[i];
+            if (seen >= target)
+            {
+                uint64_t value = BucketValue(i);
+                return value < _max ? value : _max;
+            }
+        }
+        return _max;
+    }
+    // 合并另一个快照，比如把所有EventLoop的数据汇总
+    void Merge(const HistogramSnapshot &other)
+    {
+        for (size_t i = 0; i < _counts.size(); i++)
+        {
+            _counts[i] += other._counts[i];
+        }
+        _total += other._total;
+        _sum += other._sum;
+        _max = other._max > _max ? other._max : _max;
+    }
+};
+
+class Histogram
+{
+private:
+    std::atomic<uint64_t> _counts[HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> _total;
+    std::atomic<uint64_t> _sum;
+    std::atomic<uint64_t> _max;
+
+private:
+    static size_t BucketIndex(uint64_t value)
+    {
+        if (value >= (1ULL << HISTOGRAM_MAX_BITS))
+            value = (1ULL << HISTOGRAM_MAX_BITS) - 1;
+        if (value < HISTOGRAM_SUB_COUNT)
+            return value;
+        int msb = 63 - __builtin_clzll(value);
+        int shift = msb - HISTOGRAM_SUB_BITS;
+        return (shift + 1) * HISTOGRAM_SUB_COUNT + (value >> shift) - HISTOGRAM_SUB_COUNT;
+    }
+    // 只有一个写入者，读-改-写不需要原子指令，保证读取的线程不会读到撕裂的值即可
+    static void Add(std::atomic<uint64_t> &counter, uint64_t value)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+public:
+    Histogram() : _total(0), _sum(0), _max(0)
+    {
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        {
+            _counts[i].store(0, std::memory_order_relaxed);
+        }
+    }
+    // 只能在所属的EventLoop线程中调用
+    void Record(uint64_t value)
+    {
+        Add(_counts[BucketIndex(value)], 1);
+        Add(_total, 1);
+        Add(_sum, value);
+        if (value > _max.load(std::memory_order_relaxed))
+            _max.store(value, std::memory_order_relaxed);
+    }
+    // 任意线程都可以调用；和写入并发时各个计数之间可能有细微的不一致
+    HistogramSnapshot Snapshot()
+    {
+        HistogramSnapshot snapshot;
+        std::vector<uint64_t> &counts = snapshot.Counts();
+        uint64_t total = 0;
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        {
+            counts[i] = _counts[i].load(std::memory_order_relaxed);
+            total += counts[i];
+        }
+        snapshot.SetSummary(total, _sum.load(std::memory_order_relaxed), _max.load(std::memory_order_relaxed));
+        return snapshot;
+    }
+};
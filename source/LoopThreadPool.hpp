@@ -1,9 +1,22 @@
 #pragma once
 
 #include "EventLoop.hpp"
+#include "Affinity.hpp"
 
 #include <condition_variable>
 
+// 从属线程EventLoop的配置，由LoopThreadPool统一设置
+struct LoopOptions
+{
+    PollerType type;       // EventLoop使用的Poller后端
+    bool inline_timer;     // 是否使用内联定时器（不使用timerfd）
+    uint32_t busy_poll_us; // 阻塞之前的空转时间，0表示不使用忙轮询
+    bool stats;            // 是否开启直方图统计
+    bool heartbeat;        // 是否开启看门狗检查的心跳
+    int cpu;               // 绑定的CPU，-1表示不绑定
+    LoopOptions(PollerType t = POLLER_EPOLL) : type(t), inline_timer(false), busy_poll_us(0), stats(false), heartbeat(false), cpu(-1) {}
+};
+
 class LoopThread
 {
 private:
@@ -11,12 +24,23 @@ private:
     std::mutex _mutex;             // 互斥锁
     std::condition_variable _cond; // 条件变量
     EventLoop *_loop;              // EventLoop指针变量，这个对象需要在线程内实例化
+    LoopOptions _options;          // EventLoop的配置
     std::thread _thread;           // EventLoop对应的线程
 private:
     /*实例化 EventLoop 对象，唤醒_cond上有可能阻塞的线程，并且开始运行EventLoop模块的功能*/
     void ThreadEntry()
     {
-        EventLoop loop;
+        // 先绑定CPU再实例化EventLoop，之后在这个线程中分配的内存都来自本结点
+        if (_options.cpu >= 0)
+            CpuTopology::PinCurrentThread(_options.cpu);
+        EventLoop loop(_options.type);
+        if (_options.inline_timer)
+            loop.EnableInlineTimer();
+        loop.SetBusyPoll(_options.busy_poll_us);
+        if (_options.stats)
+            loop.EnableStats();
+        if (_options.heartbeat)
+            loop.EnableHeartbeat();
         {
             std::unique_lock<std::mutex> lock(_mutex); // 加锁
             _loop = &loop;
@@ -27,7 +51,8 @@ private:
 
 public:
     /*创建线程，设定线程入口函数*/
-    LoopThread() : _loop(NULL), _thread(std::thread(&LoopThread::ThreadEntry, this)) {}
+    LoopThread(const LoopOptions &options = LoopOptions()) : _loop(NULL), _options(options),
+                                                             _thread(std::thread(&LoopThread::ThreadEntry, this)) {}
     /*返回当前线程关联的EventLoop对象指针*/
     EventLoop *GetLoop()
     {
@@ -47,25 +72,138 @@ class LoopThreadPool
 private:
     int _thread_count;
     int _next_idx;
+    LoopOptions _options;
+    /*CPU绑定：可以手动指定主线程和各个从属线程的CPU，也可以按拓扑自动分布*/
+    int _base_cpu;             // 主线程绑定的CPU，-1表示不绑定
+    std::vector<int> _cpus;    // 从属线程i绑定到_cpus[i % size]
+    bool _auto_placement;      // 按物理核心和NUMA结点自动分布
+    size_t _mesh_capacity;     // EventLoop之间每个队列的容量，0表示不建立网格
+    std::vector<std::unique_ptr<SpscRing>> _rings;
     EventLoop *_baseloop;
     std::vector<LoopThread *> _threads;
     std::vector<EventLoop *> _loops;
 
+private:
+    // 第i个EventLoop发往第j个的队列是_rings[i * n + j]
+    void CreateMesh()
+    {
+        std::vector<EventLoop *> loops = Loops();
+        size_t n = loops.size();
+        if (n < 2)
+            return;
+        _rings.resize(n * n);
+        for (size_t i = 0; i < n; i++)
+        {
+            for (size_t j = 0; j < n; j++)
+            {
+                if (i != j)
+                    _rings[i * n + j].reset(new SpscRing(_mesh_capacity));
+            }
+            loops[i]->SetMeshIndex(i);
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            std::vector<SpscRing *> out(n, NULL), in;
+            for (size_t j = 0; j < n; j++)
+            {
+                if (i == j)
+                    continue;
+                out[j] = _rings[i * n + j].get();
+                in.push_back(_rings[j * n + i].get());
+            }
+            EventLoop *loop = loops[i];
+            loop->RunInLoop([loop, loops, out, in]()
+                            { loop->InstallMesh(loops, out, in); });
+        }
+    }
+
 public:
-    LoopThreadPool(EventLoop *baseloop) : _thread_count(0), _next_idx(0), _baseloop(baseloop) {}
+    LoopThreadPool(EventLoop *baseloop, PollerType type = POLLER_EPOLL) : _thread_count(0), _next_idx(0),
+                                                                          _options(type), _base_cpu(-1),
+                                                                          _auto_placement(false), _mesh_capacity(0),
+                                                                          _baseloop(baseloop) {}
     void SetThreadCount(int count) { _thread_count = count; }
+    // 从属线程的EventLoop使用内联定时器，需要在Create之前调用
+    void EnableInlineTimer() { _options.inline_timer = true; }
+    // 从属线程的EventLoop在阻塞之前最多空转us微秒，需要在Create之前调用
+    void SetBusyPoll(uint32_t us) { _options.busy_poll_us = us; }
+    // 从属线程的EventLoop开启直方图统计，需要在Create之前调用
+    void EnableStats() { _options.stats = true; }
+    // 从属线程的EventLoop开启心跳，供看门狗检查，需要在Create之前调用
+    void EnableHeartbeat() { _options.heartbeat = true; }
+    // 主线程（调用Create的线程）绑定到cpu上，需要在Create之前调用
+    void SetBaseCpu(int cpu) { _base_cpu = cpu; }
+    // 从属线程依次绑定到cpus上，线程比CPU多时循环使用，需要在Create之前调用
+    void SetCpus(const std::vector<int> &cpus) { _cpus = cpus; }
+    // 按拓扑自动绑定：主线程和从属线程依次分布在各个NUMA结点的不同物理核心上，优先于手动指定
+    void EnableAutoPlacement() { _auto_placement = true; }
+    // 在所有EventLoop（包括主线程）两两之间建立单生产者单消费者队列，供EventLoop::SendTo使用，需要在Create之前调用
+    void EnableMesh(size_t capacity = 1024) { _mesh_capacity = capacity; }
+    // 所有EventLoop，第0个是主线程
+    std::vector<EventLoop *> Loops()
+    {
+        std::vector<EventLoop *> loops(1, _baseloop);
+        loops.insert(loops.end(), _loops.begin(), _loops.end());
+        return loops;
+    }
+    // 每个从属线程事件循环统计的快照
+    std::vector<LoopStatsSnapshot> StatsSnapshot()
+    {
+        std::vector<LoopStatsSnapshot> snapshots;
+        for (auto &loop : _loops)
+        {
+            snapshots.push_back(loop->StatsSnapshot());
+        }
+        return snapshots;
+    }
+    // 所有从属线程忙轮询统计信息的总和
+    LoopPollStats PollStats()
+    {
+        LoopPollStats total = {0, 0, 0, 0};
+        for (auto &loop : _loops)
+        {
+            LoopPollStats stats = loop->PollStats();
+            total.spin_us += stats.spin_us;
+            total.block_us += stats.block_us;
+            total.spin_hits += stats.spin_hits;
+            total.blocks += stats.blocks;
+        }
+        return total;
+    }
+    // 需要在主线程（_baseloop所在的线程）中调用
     void Create()
     {
+        if (_auto_placement)
+        {
+            std::vector<int> order = CpuTopology::SpreadCpus();
+            if (!order.empty())
+            {
+                _base_cpu = order[0];
+                _cpus.assign(order.begin() + (order.size() > 1 ? 1 : 0), order.end());
+            }
+        }
         if (_thread_count > 0)
         {
             _threads.resize(_thread_count);
             _loops.resize(_thread_count);
             for (int i = 0; i < _thread_count; i++)
             {
-                _threads[i] = new LoopThread();
+                LoopOptions options = _options;
+                if (!_cpus.empty())
+                    options.cpu = _cpus[i % _cpus.size()];
+                _threads[i] = new LoopThread(options);
                 _loops[i] = _threads[i]->GetLoop();
             }
         }
+        // 主线程最后绑定：新线程继承创建者的绑定，先绑定的话没有指定CPU的从属线程也会被限制在主线程的CPU上
+        if (_base_cpu >= 0)
+        {
+            CpuTopology::PinCurrentThread(_base_cpu);
+        }
+        if (_mesh_capacity > 0)
+        {
+            CreateMesh();
+        }
         return;
     }
     EventLoop *NextLoop()
@@ -77,4 +215,4 @@ public:
         _next_idx = (_next_idx + 1) % _thread_count;
         return _loops[_next_idx];
     }
-};
\ No newline at end of file
+};
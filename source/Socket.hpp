@@ -2,9 +2,11 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <string.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -111,7 +113,12 @@ public:
     {
         // ssize_t recv(int sockfd, void *buf, size_t len, int flag);
         ssize_t ret = recv(_sockfd, buf, len, flag);
-        if (ret <= 0)
+        if (ret == 0)
+        {
+            // 对端关闭了连接，此时errno没有被设置，不能用它来判断
+            return -1;
+        }
+        if (ret < 0)
         {
             // EAGAIN 当前socket的接收缓冲区中没有数据了，在非阻塞的情况下才会有这个错误
             // EINTR  表示当前socket的阻塞等待，被信号打断了，
@@ -144,12 +151,33 @@ public:
         }
         return ret; // 实际发送的数据长度
     }
-    ssize_t NonBlockSend(void *buf, size_t len)
+    ssize_t NonBlockSend(const void *buf, size_t len)
     {
         if (len == 0)
             return 0;
         return Send(buf, len, MSG_DONTWAIT); // MSG_DONTWAIT 表示当前发送为非阻塞。
     }
+    // 一次发送多段数据（块链缓冲区中不连续的数据），返回值和Send一致
+    ssize_t NonBlockSendv(const struct iovec *iov, int count)
+    {
+        if (count == 0)
+            return 0;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (struct iovec *)iov;
+        msg.msg_iovlen = count;
+        ssize_t ret = sendmsg(_sockfd, &msg, MSG_DONTWAIT);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+            {
+                return 0;
+            }
+            ERR_LOG("SOCKET SEND FAILED!!");
+            return -1;
+        }
+        return ret;
+    }
     // 关闭套接字
     void Close()
     {
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+#include "Watchdog.hpp"
+
+/*有界的单生产者单消费者环形队列，用于两个EventLoop之间直接传递任务
+ * 生产者和消费者各自只写自己的下标，并缓存对方的下标，只有缓存的值判断为满/空时才重新读取，
+ * 两个下标分别放在不同的缓存行中，正常情况下一次传递只有槽位本身的缓存行在两个核心之间移动。*/
+#define SPSC_CACHELINE 64
+class SpscRing
+{
+private:
+    using Functor = std::function<void()>;
+
+    std::vector<Functor> _slots;
+    size_t _mask;
+    // 使用填充而不是alignas：C++17之前new不保证超出默认对齐的对象
+    char _pad0[SPSC_CACHELINE];
+    std::atomic<size_t> _head; // 下一个写入的位置，只有生产者修改
+    size_t _cached_tail;       // 生产者缓存的_tail
+    char _pad1[SPSC_CACHELINE - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+    std::atomic<size_t> _tail; // 下一个读取的位置，只有消费者修改
+    size_t _cached_head;       // 消费者缓存的_head
+    char _pad2[SPSC_CACHELINE - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+
+public:
+    // capacity会向上取整为2的幂
+    SpscRing(size_t capacity) : _mask(0), _head(0), _cached_tail(0), _tail(0), _cached_head(0)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        _slots.resize(size);
+        _mask = size - 1;
+    }
+    // 只能在生产者线程调用，满了返回false
+    bool Push(const Functor &task)
+    {
+        size_t head = _head.load(std::memory_order_relaxed);
+        if (head - _cached_tail > _mask)
+        {
+            _cached_tail = _tail.load(std::memory_order_acquire);
+            if (head - _cached_tail > _mask)
+                return false;
+        }
+        _slots[head & _mask] = task;
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+    // 只能在消费者线程调用
+    bool Empty()
+    {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail != _cached_head)
+            return false;
+        _cached_head = _head.load(std::memory_order_acquire);
+        return tail == _cached_head;
+    }
+    // 执行调用时已经在队列中的所有任务，返回执行的个数，只能在消费者线程调用
+    size_t RunAll(LoopHeartbeat *beat = NULL)
+    {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        size_t head = _head.load(std::memory_order_acquire);
+        _cached_head = head;
+        size_t count = 0;
+        for (; tail != head; tail++)
+        {
+            Functor task;
+            task.swap(_slots[tail & _mask]);
+            // 先释放槽位再执行，任务中生产者就可以继续写入
+            _tail.store(tail + 1, std::memory_order_release);
+            LoopBeat guard(beat, BEAT_TASK, -1, 0, 0, beat ? task.target_type().name() : NULL);
+            task();
+            count++;
+        }
+        return count;
+    }
+};
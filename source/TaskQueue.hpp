@@ -0,0 +1,181 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+
+#include "Watchdog.hpp"
+
+/*无锁的多生产者单消费者任务队列（侵入式链表，Vyukov MPSC）
+ * 生产者：任意线程，一次原子交换就完成入队，互相之间以及和EventLoop线程之间都没有锁竞争；
+ * 消费者：只能是EventLoop线程。
+ * 结点回收：消费者把用完的结点压入_free栈，生产者一次性把整个_free栈取到线程本地缓存中再使用，
+ *          取的时候使用exchange，因此不存在ABA问题。*/
+class TaskQueue
+{
+private:
+    using Functor = std::function<void()>;
+    struct Node
+    {
+        std::atomic<Node *> next;
+        Functor task;
+    };
+    // 每个线程缓存的空闲结点，所有TaskQueue共用（结点类型都一样），线程退出时释放
+    struct NodeCache
+    {
+        Node *head;
+        NodeCache() : head(NULL) {}
+        ~NodeCache()
+        {
+            while (head)
+            {
+                Node *next = head->next.load(std::memory_order_relaxed);
+                delete head;
+                head = next;
+            }
+        }
+    };
+
+    std::atomic<Node *> _head; // 最后入队的结点，生产者在这里追加
+    Node *_tail;               // 下一个要出队的结点，只有消费者访问
+    Node _stub;                // 哨兵结点，队列为空时_head/_tail都指向它
+    std::atomic<Node *> _free; // 消费者回收的空闲结点
+
+private:
+    static NodeCache &Cache()
+    {
+        static thread_local NodeCache cache;
+        return cache;
+    }
+    Node *AllocNode()
+    {
+        NodeCache &cache = Cache();
+        if (cache.head == NULL)
+        {
+            cache.head = _free.exchange(NULL, std::memory_order_acquire);
+        }
+        Node *node = cache.head;
+        if (node == NULL)
+        {
+            return new Node();
+        }
+        cache.head = node->next.load(std::memory_order_relaxed);
+        return node;
+    }
+    // 消费者把结点还回去；只有一个压入者，CAS失败只可能是生产者把整个栈取走了
+    void FreeNode(Node *node)
+    {
+        Node *top = _free.load(std::memory_order_relaxed);
+        do
+        {
+            node->next.store(top, std::memory_order_relaxed);
+        } while (!_free.compare_exchange_weak(top, node, std::memory_order_release, std::memory_order_relaxed));
+    }
+    void PushNode(Node *node)
+    {
+        node->next.store(NULL, std::memory_order_relaxed);
+        Node *prev = _head.exchange(node, std::memory_order_acq_rel);
+        // 在这一步完成之前，消费者看到的是一个“断开”的链表，会认为暂时没有数据
+        prev->next.store(node, std::memory_order_release);
+    }
+    // 取出一个结点；返回NULL表示队列为空，或者有生产者正在入队的中间状态
+    Node *PopNode()
+    {
+        Node *tail = _tail;
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (tail == &_stub)
+        {
+            if (next == NULL)
+            {
+                return NULL;
+            }
+            _tail = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next)
+        {
+            _tail = next;
+            return tail;
+        }
+        if (tail != _head.load(std::memory_order_acquire))
+        {
+            return NULL;
+        }
+        // tail是最后一个结点，重新放入哨兵之后才能把它取出来
+        PushNode(&_stub);
+        next = tail->next.load(std::memory_order_acquire);
+        if (next)
+        {
+            _tail = next;
+            return tail;
+        }
+        return NULL;
+    }
+
+public:
+    TaskQueue() : _head(&_stub), _tail(&_stub), _free(NULL)
+    {
+        _stub.next.store(NULL, std::memory_order_relaxed);
+    }
+    ~TaskQueue()
+    {
+        Node *node;
+        while ((node = PopNode()) != NULL)
+        {
+            delete node;
+        }
+        node = _free.exchange(NULL, std::memory_order_acquire);
+        while (node)
+        {
+            Node *next = node->next.load(std::memory_order_relaxed);
+            delete node;
+            node = next;
+        }
+    }
+    // 任意线程都可以调用
+    void Push(const Functor &task)
+    {
+        Node *node = AllocNode();
+        node->task = task;
+        PushNode(node);
+    }
+    // 队列中是否还有任务（包括正在入队的），只能在消费者线程调用
+    bool Empty()
+    {
+        if (_tail != &_stub)
+        {
+            return false; // _tail指向的不是哨兵，说明它本身就是一个还没执行的任务
+        }
+        return _head.load(std::memory_order_acquire) == &_stub;
+    }
+    // 执行调用时已经在队列中的所有任务，执行过程中新加入的任务留到下一轮，只能在消费者线程调用
+    // beat不为NULL时，每个任务都在心跳中标记，供看门狗检查
+    size_t RunAll(LoopHeartbeat *beat = NULL)
+    {
+        Node *last = _head.load(std::memory_order_acquire);
+        if (last == &_stub)
+        {
+            return 0;
+        }
+        size_t count = 0;
+        Node *node;
+        while ((node = PopNode()) != NULL)
+        {
+            Functor task;
+            task.swap(node->task);
+            bool done = (node == last);
+            FreeNode(node);
+            {
+                LoopBeat guard(beat, BEAT_TASK, -1, 0, 0, beat ? task.target_type().name() : NULL);
+                task();
+            }
+            count++;
+            if (done)
+            {
+                break;
+            }
+        }
+        return count;
+    }
+};
@@ -5,6 +5,8 @@
 #include "Log.hpp"
 #include "LoopThreadPool.hpp"
 #include "Signal.hpp"
+#include "WorkerPool.hpp"
+#include "Watchdog.hpp"
 
 class TcpServer
 {
@@ -14,10 +16,18 @@ private:
     int _port;
     int _timeout;                  // 这是非活跃连接的统计时间---多长时间无通信就是非活跃连接
     bool _enable_inactive_release; // 是否启动了非活跃连接超时销毁的判断标志
+    bool _edge_trigger;            // 通信连接是否使用边沿触发，默认水平触发
+    size_t _read_budget;           // 每个连接一次可读事件最多读取的字节数，0表示不限制
+    uint32_t _message_budget;      // 每个连接一次消息回调最多处理的消息数，0表示不限制
+    uint32_t _shrink_idle_ms;      // 连接空闲多久收缩缓冲区，0表示不开启
+    uint64_t _shrink_threshold;    // 输入缓冲区处理完之后还保留的最大容量，0表示不立即收缩
 
     EventLoop _baseloop;  // 这是主线程的EventLoop对象，负责监听事件的处理
     Acceptor _acceptor;   // 这是监听套接字的管理对象
     LoopThreadPool _pool; // 这是从属EventLoop线程池
+    int _worker_count;    // 业务线程数，和EventLoop线程数分开设置
+    WorkerPool _workers;  // 业务线程池
+    LoopWatchdog _watchdog; // 检查EventLoop卡顿的看门狗，必须声明在EventLoop之后，先于它们停止
 
     std::unordered_map<uint64_t, PtrConnection> _conns; // 保存管理所有连接对应的shared_ptr对象
 
@@ -34,25 +44,35 @@ private:
     AnyEventCallback _event_callback;
 
 private:
-    void RunAfterInLoop(const Functor &task, int delay)
-    {
-        _next_id++;
-        _baseloop.TimerAdd(_next_id, delay, task);
-    }
     // 为新连接构造一个Connection进行管理
     void NewConnection(int fd)
     {
         _next_id++;
-        PtrConnection conn(new Connection(_pool.NextLoop(), _next_id, fd));
+        EventLoop *loop = _pool.NextLoop();
+        // 在连接所属的线程中构造，Connection和它的缓冲区都从该线程（绑定的CPU所在的NUMA结点）分配
+        loop->RunInLoop(std::bind(&TcpServer::NewConnectionInLoop, this, loop, _next_id, fd));
+    }
+    void NewConnectionInLoop(EventLoop *loop, uint64_t id, int fd)
+    {
+        PtrConnection conn(new Connection(loop, id, fd));
         conn->SetMessageCallback(_message_callback);
         conn->SetClosedCallback(_closed_callback);
         conn->SetConnectedCallback(_connected_callback);
         conn->SetAnyEventCallback(_event_callback);
         conn->SetSrvClosedCallback(std::bind(&TcpServer::RemoveConnection, this, std::placeholders::_1));
+        conn->SetEdgeTrigger(_edge_trigger);
+        conn->SetReadBudget(_read_budget);
+        conn->SetMessageBudget(_message_budget);
+        conn->SetBufferShrink(_shrink_idle_ms, _shrink_threshold);
         if (_enable_inactive_release)
             conn->EnableInactiveRelease(_timeout); // 启动非活跃超时销毁
-        conn->Established();                       // 就绪初始化
-        _conns.insert(std::make_pair(_next_id, conn));
+        // _conns只在主线程中访问；先投递添加，之后连接关闭时投递的移除一定排在它后面
+        _baseloop.RunInLoop(std::bind(&TcpServer::AddConnectionInLoop, this, conn));
+        conn->Established(); // 就绪初始化
+    }
+    void AddConnectionInLoop(const PtrConnection &conn)
+    {
+        _conns.insert(std::make_pair(conn->Id(), conn));
     }
     void RemoveConnectionInLoop(const PtrConnection &conn)
     {
@@ -70,35 +90,131 @@ private:
     }
 
 public:
-    TcpServer(int port) : _port(port),
-                          _next_id(0),
-                          _enable_inactive_release(false),
-                          _acceptor(&_baseloop, port),
-                          _pool(&_baseloop)
+    // type选择所有EventLoop使用的Poller后端，默认epoll
+    TcpServer(int port, PollerType type = POLLER_EPOLL) : _port(port),
+                                                          _next_id(0),
+                                                          _enable_inactive_release(false),
+                                                          _edge_trigger(false),
+                                                          _read_budget(0),
+                                                          _message_budget(0),
+                                                          _shrink_idle_ms(0),
+                                                          _shrink_threshold(0),
+                                                          _baseloop(type),
+                                                          _acceptor(&_baseloop, port),
+                                                          _pool(&_baseloop, type),
+                                                          _worker_count(0)
     {
         _acceptor.SetAcceptCallback(std::bind(&TcpServer::NewConnection, this, std::placeholders::_1));
         _acceptor.Listen(); // 将监听套接字挂到baseloop上
     }
 
     void SetThreadCount(int count) { return _pool.SetThreadCount(count); }
+    // 业务线程数，需要在Start之前调用；0表示不使用业务线程池，RunInWorker直接在调用线程中执行
+    void SetWorkerThreadCount(int count) { _worker_count = count; }
+    bool HasWorkers() { return _worker_count > 0; }
+    // 把耗时的业务处理交给业务线程池，处理结果通过Connection::Send或者连接所属EventLoop的RunInLoop送回
+    void RunInWorker(const Functor &task) { _workers.Submit(task); }
     void SetConnectedCallback(const ConnectedCallback &cb) { _connected_callback = cb; }
     void SetMessageCallback(const MessageCallback &cb) { _message_callback = cb; }
     void SetClosedCallback(const ClosedCallback &cb) { _closed_callback = cb; }
     void SetAnyEventCallback(const AnyEventCallback &cb) { _event_callback = cb; }
 
+    // 通信连接使用边沿触发：每次可读/可写事件都一直读/写到EAGAIN
+    void EnableEdgeTrigger() { _edge_trigger = true; }
+    // 每个连接一次事件的处理预算，超出的部分留到其他连接处理完之后再继续，保证同一EventLoop上其他连接的延迟
+    // bytes：边沿触发时一次最多读取的字节数；messages：一次消息回调最多处理的消息数（消息回调需要调用ConsumeMessageBudget）
+    void SetEventBudget(size_t bytes, uint32_t messages)
+    {
+        _read_budget = bytes;
+        _message_budget = messages;
+    }
+    // 所有EventLoop都不使用timerfd，由事件监控的超时时间驱动定时器，需要在Start之前调用
+    void EnableInlineTimer()
+    {
+        _baseloop.EnableInlineTimer();
+        _pool.EnableInlineTimer();
+    }
+    // 从属线程在阻塞之前最多空转us微秒，降低小请求的唤醒延迟，适合独占CPU核心的部署，需要在Start之前调用
+    void SetBusyPoll(uint32_t us) { _pool.SetBusyPoll(us); }
+    // 从属线程空转/阻塞时间的统计
+    LoopPollStats PollStats() { return _pool.PollStats(); }
+    // 所有EventLoop开启事件循环的直方图统计（就绪等待/回调/任务的耗时，就绪事件数，任务积压），需要在Start之前调用
+    void EnableLoopStats()
+    {
+        _baseloop.EnableStats();
+        _pool.EnableStats();
+    }
+    // 开启看门狗：任何EventLoop中的一个回调执行超过ms毫秒，就记录一次卡顿并打印回调的信息，
+    // backtrace为true时同时打印卡住线程的调用栈；需要在Start之前调用
+    void EnableWatchdog(uint32_t ms, bool backtrace = false)
+    {
+        _watchdog.SetThreshold(ms, backtrace);
+        _baseloop.EnableHeartbeat();
+        _pool.EnableHeartbeat();
+    }
+    // 看门狗发现的卡顿总次数，每个EventLoop的次数见EventLoop::StallCount
+    uint64_t StallCount() { return _watchdog.Stalls(); }
+    // 最近一次卡顿的记录，还没有发生过返回false
+    bool LastStall(StallReport *report) { return _watchdog.LastStall(report); }
+    // 主线程和从属线程分别绑定到指定的CPU上（base_cpu为-1表示主线程不绑定），需要在Start之前调用
+    void SetCpuAffinity(int base_cpu, const std::vector<int> &cpus)
+    {
+        _pool.SetBaseCpu(base_cpu);
+        _pool.SetCpus(cpus);
+    }
+    // 按物理核心和NUMA结点自动分布所有EventLoop线程，需要在Start之前调用
+    void EnableAutoPlacement() { _pool.EnableAutoPlacement(); }
+    // 在所有EventLoop两两之间建立单生产者单消费者队列，EventLoop::SendTo据此直接把任务交给其他EventLoop，需要在Start之前调用
+    void EnableLoopMesh(size_t capacity = 1024) { _pool.EnableMesh(capacity); }
+    // 所有EventLoop，第0个是主线程，Start之后才包含从属线程
+    std::vector<EventLoop *> Loops() { return _pool.Loops(); }
+    // 各个EventLoop统计的快照：第0个是主线程，之后依次是从属线程；需要汇总时可以使用LoopStatsSnapshot::Merge
+    std::vector<LoopStatsSnapshot> LoopStatsSnapshots()
+    {
+        std::vector<LoopStatsSnapshot> snapshots = _pool.StatsSnapshot();
+        snapshots.insert(snapshots.begin(), _baseloop.StatsSnapshot());
+        return snapshots;
+    }
+    /*缓冲区收缩：连接的输入缓冲区处理完之后容量超过threshold字节就立即释放；连接空闲超过idle_ms毫秒，
+     * 释放它的缓冲区多余的内存；每个EventLoop每idle_ms毫秒把BufferPool中一直没有用到的空闲块还给系统。
+     * 长连接收过大请求之后内存不会一直被占着，需要在Start之前调用*/
+    void EnableBufferShrink(uint32_t idle_ms, uint64_t threshold = 64 * 1024)
+    {
+        _shrink_idle_ms = idle_ms;
+        _shrink_threshold = threshold;
+    }
     void EnableInactiveRelease(int timeout)
     {
         _timeout = timeout;
         _enable_inactive_release = true;
     }
-    // 用于添加一个定时任务
-    void RunAfter(const Functor &task, int delay)
+    // 用于添加一个定时任务，delay的单位是秒，在主线程中执行
+    TimerHandle RunAfter(const Functor &task, int delay)
     {
-        _baseloop.RunInLoop(std::bind(&TcpServer::RunAfterInLoop, this, task, delay));
+        return _baseloop.RunAfter(delay * 1000, task);
     }
+    // 毫秒精度的定时任务，在主线程中执行，返回的句柄可以在任意线程中通过CancelTimer取消
+    TimerHandle RunAfterMs(uint32_t ms, const Functor &task) { return _baseloop.RunAfter(ms, task); }
+    TimerHandle RunEvery(uint32_t ms, const Functor &task) { return _baseloop.RunEvery(ms, task); }
+    TimerHandle RunAt(std::chrono::steady_clock::time_point when, const Functor &task) { return _baseloop.RunAt(when, task); }
+    void CancelTimer(const TimerHandle &handle) { _baseloop.Cancel(handle); }
     void Start()
     {
+        _workers.Start(_worker_count);
         _pool.Create();
+        if (_shrink_idle_ms > 0)
+        {
+            // 定时任务在各自的EventLoop线程中执行，整理的是那个线程的BufferPool
+            for (auto &loop : _pool.Loops())
+                loop->RunEvery(_shrink_idle_ms, []()
+                               { BufferPool::Local()->Trim(); });
+        }
+        if (_watchdog.Threshold() > 0)
+        {
+            for (auto &loop : _pool.Loops())
+                _watchdog.Watch(loop->Heartbeat());
+            _watchdog.Start();
+        }
         _baseloop.Start();
     }
 };
\ No newline at end of file
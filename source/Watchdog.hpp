@@ -0,0 +1,301 @@
+#pragma once
+
+#include "Log.hpp"
+#include "Affinity.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cxxabi.h>
+#include <execinfo.h>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+// EventLoop正在执行的回调类型
+typedef enum
+{
+    BEAT_IDLE,   // 没有在执行回调（阻塞在事件监控中或者处于两个回调之间）
+    BEAT_EVENT,  // 描述符事件
+    BEAT_RECV,   // io_uring收到数据
+    BEAT_ACCEPT, // io_uring接受了新连接
+    BEAT_TIMER,  // 定时任务
+    BEAT_TASK,   // 任务池中的任务
+} BeatPhase;
+
+/*EventLoop的心跳：每开始一个回调，序号加1并记下开始时间和回调的信息，结束时清零开始时间
+ * 只有EventLoop线程写入，看门狗线程读取；看门狗发现同一个回调执行太久，就说明这个EventLoop卡住了*/
+struct LoopHeartbeat
+{
+    std::atomic<uint64_t> seq;         // 已经开始的回调个数
+    std::atomic<uint64_t> start_ns;    // 当前回调开始的时间，0表示没有在执行回调
+    std::atomic<int> phase;            // BeatPhase
+    std::atomic<int> fd;               // 事件所属的描述符，-1表示没有
+    std::atomic<uint32_t> events;      // 就绪的事件
+    std::atomic<uint64_t> tag;         // 连接ID（定时任务为定时器ID），0表示没有
+    std::atomic<const char *> name;    // 回调的类型名（typeid的名字），可能为NULL
+    std::atomic<uint64_t> stalls;      // 被看门狗发现卡住的次数
+    pthread_t thread;                  // EventLoop线程，用于发送采集调用栈的信号
+
+    LoopHeartbeat() : seq(0), start_ns(0), phase(BEAT_IDLE), fd(-1), events(0), tag(0), name(NULL), stalls(0),
+                      thread(pthread_self()) {}
+    static uint64_t NowNs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+};
+
+/*在作用域内标记一个回调，beat为NULL（没有开启看门狗）时什么都不做
+ * 回调中嵌套执行的回调（比如timerfd事件中执行的定时任务）覆盖外层的信息，结束后恢复外层的*/
+class LoopBeat
+{
+private:
+    LoopHeartbeat *_beat;
+    uint64_t _outer_start;
+    int _outer_phase;
+    int _outer_fd;
+    uint32_t _outer_events;
+    uint64_t _outer_tag;
+    const char *_outer_name;
+
+public:
+    LoopBeat(LoopHeartbeat *beat, BeatPhase phase, int fd, uint32_t events, uint64_t tag, const char *name) : _beat(beat)
+    {
+        if (_beat == NULL)
+            return;
+        _outer_start = _beat->start_ns.load(std::memory_order_relaxed);
+        _outer_phase = _beat->phase.load(std::memory_order_relaxed);
+        _outer_fd = _beat->fd.load(std::memory_order_relaxed);
+        _outer_events = _beat->events.load(std::memory_order_relaxed);
+        _outer_tag = _beat->tag.load(std::memory_order_relaxed);
+        _outer_name = _beat->name.load(std::memory_order_relaxed);
+        _beat->seq.store(_beat->seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        _beat->phase.store(phase, std::memory_order_relaxed);
+        _beat->fd.store(fd, std::memory_order_relaxed);
+        _beat->events.store(events, std::memory_order_relaxed);
+        _beat->tag.store(tag, std::memory_order_relaxed);
+        _beat->name.store(name, std::memory_order_relaxed);
+        // 最后写入开始时间：看门狗读到开始时间，就能读到上面的信息
+        _beat->start_ns.store(LoopHeartbeat::NowNs(), std::memory_order_release);
+    }
+    ~LoopBeat()
+    {
+        if (_beat == NULL)
+            return;
+        _beat->start_ns.store(0, std::memory_order_release);
+        if (_outer_start == 0)
+            return;
+        // 恢复外层回调；序号不变，内层已经报告过的卡顿不会因为回到外层再报告一次
+        _beat->phase.store(_outer_phase, std::memory_order_relaxed);
+        _beat->fd.store(_outer_fd, std::memory_order_relaxed);
+        _beat->events.store(_outer_events, std::memory_order_relaxed);
+        _beat->tag.store(_outer_tag, std::memory_order_relaxed);
+        _beat->name.store(_outer_name, std::memory_order_relaxed);
+        _beat->start_ns.store(_outer_start, std::memory_order_release);
+    }
+};
+
+// 一次卡顿的记录
+struct StallReport
+{
+    pthread_t thread;   // 卡住的EventLoop线程
+    BeatPhase phase;    // 卡在哪一类回调中
+    int fd;             // 描述符，-1表示没有
+    uint32_t events;    // 就绪的事件
+    uint64_t tag;       // 连接ID（定时任务为定时器ID），0表示没有
+    std::string name;   // 回调的类型名（已经还原成可读的形式）
+    uint64_t blocked_ms; // 发现时已经执行的时间
+};
+
+#define WATCHDOG_SIGNAL (SIGRTMIN + 4) // 让卡住的EventLoop线程打印自己调用栈的信号
+#define WATCHDOG_BACKTRACE_DEPTH 64
+/*看门狗：独立的线程定期检查各个EventLoop的心跳，一个回调执行超过阈值就记录一次（同一个回调只记录一次）：
+ * 计数加1，打印是哪一类回调、描述符、连接ID、回调类型，开启调用栈采集时再让那个线程把自己的调用栈打印出来*/
+class LoopWatchdog
+{
+private:
+    struct Watched
+    {
+        LoopHeartbeat *beat;
+        uint64_t reported_seq; // 已经报告过的回调序号，同一个回调不重复报告
+    };
+    std::vector<Watched> _watched;
+    uint32_t _threshold_ms; // 一个回调执行超过多久算卡住，0表示不开启
+    bool _backtrace;        // 是否采集卡住线程的调用栈
+    std::atomic<uint64_t> _stalls;
+    std::mutex _mutex; // 保护_last和_stop
+    std::condition_variable _cond;
+    bool _stop;
+    bool _has_last;
+    StallReport _last;
+    std::thread _thread;
+
+private:
+    static const char *PhaseName(int phase)
+    {
+        switch (phase)
+        {
+        case BEAT_EVENT:
+            return "EVENT";
+        case BEAT_RECV:
+            return "RECV";
+        case BEAT_ACCEPT:
+            return "ACCEPT";
+        case BEAT_TIMER:
+            return "TIMER";
+        case BEAT_TASK:
+            return "TASK";
+        }
+        return "IDLE";
+    }
+    static std::string Demangle(const char *name)
+    {
+        if (name == NULL)
+            return "";
+        int status = 0;
+        char *demangled = abi::__cxa_demangle(name, NULL, NULL, &status);
+        if (demangled == NULL)
+            return name;
+        std::string result(demangled);
+        free(demangled);
+        return result;
+    }
+    // 在卡住的EventLoop线程中执行，backtrace_symbols_fd不分配内存，直接写到标准输出
+    static void OnBacktraceSignal(int)
+    {
+        void *frames[WATCHDOG_BACKTRACE_DEPTH];
+        int n = backtrace(frames, WATCHDOG_BACKTRACE_DEPTH);
+        backtrace_symbols_fd(frames, n, STDOUT_FILENO);
+    }
+    void InstallSignal()
+    {
+        // 先调用一次backtrace，把它依赖的库加载好，信号处理函数中就不会再去加载
+        void *frame;
+        backtrace(&frame, 1);
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &LoopWatchdog::OnBacktraceSignal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(WATCHDOG_SIGNAL, &sa, NULL);
+    }
+    // 检查一个EventLoop，卡住了返回true并填写report
+    bool Check(Watched &watched, uint64_t now, StallReport *report)
+    {
+        LoopHeartbeat *beat = watched.beat;
+        uint64_t start = beat->start_ns.load(std::memory_order_acquire);
+        if (start == 0 || now < start || now - start < (uint64_t)_threshold_ms * 1000000)
+            return false;
+        uint64_t seq = beat->seq.load(std::memory_order_relaxed);
+        if (seq == watched.reported_seq)
+            return false;
+        report->thread = beat->thread;
+        report->phase = (BeatPhase)beat->phase.load(std::memory_order_relaxed);
+        report->fd = beat->fd.load(std::memory_order_relaxed);
+        report->events = beat->events.load(std::memory_order_relaxed);
+        report->tag = beat->tag.load(std::memory_order_relaxed);
+        const char *name = beat->name.load(std::memory_order_relaxed);
+        report->blocked_ms = (now - start) / 1000000;
+        // 读取期间回调已经结束或者换了一个，这次的信息可能不一致，下一次再检查
+        if (beat->start_ns.load(std::memory_order_acquire) != start || beat->seq.load(std::memory_order_relaxed) != seq)
+            return false;
+        report->name = Demangle(name);
+        watched.reported_seq = seq;
+        return true;
+    }
+    void Report(Watched &watched, const StallReport &report)
+    {
+        watched.beat->stalls.fetch_add(1, std::memory_order_relaxed);
+        _stalls.fetch_add(1, std::memory_order_relaxed);
+        ERR_LOG("EVENTLOOP %p STALLED FOR %lums IN %s: fd=%d events=%#x id=%lu callback=%s",
+                (void *)report.thread, (unsigned long)report.blocked_ms, PhaseName(report.phase), report.fd,
+                report.events, (unsigned long)report.tag, report.name.c_str());
+        if (_backtrace)
+        {
+            fflush(stdout); // 调用栈直接写到描述符，先把日志刷出去，保证顺序
+            pthread_kill(report.thread, WATCHDOG_SIGNAL);
+        }
+        std::unique_lock<std::mutex> lock(_mutex);
+        _last = report;
+        _has_last = true;
+    }
+    void ThreadEntry()
+    {
+        // 看门狗线程由主线程在绑定CPU之后创建，不能和主线程挤在同一个CPU上
+        CpuTopology::UnpinCurrentThread();
+        // 每个阈值周期检查4次，发现卡顿的延迟不超过阈值的1/4
+        uint32_t interval = _threshold_ms / 4 > 0 ? _threshold_ms / 4 : 1;
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (_cond.wait_for(lock, std::chrono::milliseconds(interval), [this]()
+                              { return _stop; }) == false)
+        {
+            lock.unlock();
+            uint64_t now = LoopHeartbeat::NowNs();
+            for (auto &watched : _watched)
+            {
+                StallReport report;
+                if (Check(watched, now, &report))
+                    Report(watched, report);
+            }
+            lock.lock();
+        }
+    }
+
+public:
+    LoopWatchdog() : _threshold_ms(0), _backtrace(false), _stalls(0), _stop(false), _has_last(false) {}
+    ~LoopWatchdog() { Stop(); }
+    // 回调执行超过ms毫秒就报告，backtrace为true时同时打印卡住线程的调用栈，需要在Start之前调用
+    void SetThreshold(uint32_t ms, bool backtrace = false)
+    {
+        _threshold_ms = ms;
+        _backtrace = backtrace;
+    }
+    uint32_t Threshold() { return _threshold_ms; }
+    // 添加要检查的EventLoop心跳，需要在Start之前调用
+    void Watch(LoopHeartbeat *beat)
+    {
+        if (beat == NULL)
+            return;
+        Watched watched = {beat, 0};
+        _watched.push_back(watched);
+    }
+    void Start()
+    {
+        if (_threshold_ms == 0 || _watched.empty() || _thread.joinable())
+            return;
+        if (_backtrace)
+            InstallSignal();
+        _thread = std::thread(&LoopWatchdog::ThreadEntry, this);
+    }
+    void Stop()
+    {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _cond.notify_all();
+        if (_thread.joinable())
+            _thread.join();
+    }
+    // 发现的卡顿总次数，任意线程都可以调用
+    uint64_t Stalls() { return _stalls.load(std::memory_order_relaxed); }
+    // 最近一次卡顿的记录，还没有发生过返回false
+    bool LastStall(StallReport *report)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_has_last == false)
+            return false;
+        *report = _last;
+        return true;
+    }
+};
@@ -0,0 +1,160 @@
+#pragma once
+
+#include "Log.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*业务线程池（工作窃取）：耗时的业务处理交给它执行，避免阻塞EventLoop线程上所有连接的IO
+ * 每个工作线程有自己的双端队列：自己从尾部取（后进先出，缓存更热），其他线程从头部窃取；
+ * 自己的队列空了就从随机的一个线程开始依次窃取，都没有才睡眠。
+ * EventLoop线程提交的任务轮流放入各个工作线程的队列，工作线程中提交的任务放入自己的队列。
+ * 执行结果需要回到连接所属的EventLoop中处理，比如通过Connection::Send或者EventLoop::RunInLoop。*/
+class WorkerPool
+{
+private:
+    using Functor = std::function<void()>;
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Functor> tasks;
+        std::thread thread;
+    };
+    std::vector<std::unique_ptr<Worker>> _workers;
+    std::atomic<size_t> _next;    // 外部提交时轮流选择的工作线程
+    std::atomic<size_t> _pending; // 还没有被取走的任务数
+    std::atomic<int> _sleepers;   // 正在睡眠的工作线程数，没有人睡眠时提交任务不需要加锁唤醒
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    bool _stop;
+
+private:
+    // 当前线程是哪个线程池的第几个工作线程
+    static WorkerPool *&CurrentPool()
+    {
+        static thread_local WorkerPool *pool = NULL;
+        return pool;
+    }
+    static int &CurrentIndex()
+    {
+        static thread_local int index = -1;
+        return index;
+    }
+    static uint32_t Random()
+    {
+        static thread_local uint32_t seed = (uint32_t)std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+    bool PopOwn(size_t self, Functor *task)
+    {
+        Worker &worker = *_workers[self];
+        std::unique_lock<std::mutex> lock(worker.mutex);
+        if (worker.tasks.empty())
+            return false;
+        task->swap(worker.tasks.back());
+        worker.tasks.pop_back();
+        return true;
+    }
+    bool Steal(size_t self, Functor *task)
+    {
+        size_t n = _workers.size();
+        size_t start = Random() % n;
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t victim = (start + i) % n;
+            if (victim == self)
+                continue;
+            Worker &worker = *_workers[victim];
+            std::unique_lock<std::mutex> lock(worker.mutex);
+            if (worker.tasks.empty())
+                continue;
+            task->swap(worker.tasks.front());
+            worker.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+    void ThreadEntry(size_t self)
+    {
+        CurrentPool() = this;
+        CurrentIndex() = self;
+        while (1)
+        {
+            Functor task;
+            if (PopOwn(self, &task) || Steal(self, &task))
+            {
+                _pending.fetch_sub(1);
+                task();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(_mutex);
+            _sleepers.fetch_add(1);
+            // 先登记睡眠再检查任务数，和Submit中先增加任务数再检查睡眠数配合，不会错过唤醒
+            _cond.wait(lock, [&]()
+                       { return _stop || _pending.load() > 0; });
+            _sleepers.fetch_sub(1);
+            if (_stop && _pending.load() == 0)
+                return;
+        }
+    }
+
+public:
+    WorkerPool() : _next(0), _pending(0), _sleepers(0), _stop(false) {}
+    ~WorkerPool()
+    {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _cond.notify_all();
+        for (auto &worker : _workers)
+        {
+            if (worker->thread.joinable())
+                worker->thread.join();
+        }
+    }
+    // 启动count个工作线程，只能调用一次
+    void Start(int count)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            _workers.emplace_back(new Worker());
+        }
+        for (int i = 0; i < count; i++)
+        {
+            _workers[i]->thread = std::thread(&WorkerPool::ThreadEntry, this, i);
+        }
+    }
+    size_t Size() { return _workers.size(); }
+    // 提交任务，任意线程都可以调用；没有工作线程时直接在调用线程中执行
+    void Submit(const Functor &task)
+    {
+        if (_workers.empty())
+            return task();
+        size_t idx;
+        if (CurrentPool() == this)
+            idx = CurrentIndex();
+        else
+            idx = _next.fetch_add(1, std::memory_order_relaxed) % _workers.size();
+        {
+            Worker &worker = *_workers[idx];
+            std::unique_lock<std::mutex> lock(worker.mutex);
+            worker.tasks.push_back(task);
+        }
+        _pending.fetch_add(1);
+        if (_sleepers.load() > 0)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cond.notify_one();
+        }
+    }
+};
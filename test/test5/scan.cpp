@@ -0,0 +1,264 @@
+#include "../../server/http/HttpContect.hpp"
+
+#include <cstdlib>
+#include <vector>
+
+// ByteScan的各个实现逐一和逐字节版本对比，再用HttpContext验证头部解析
+typedef const char *(*FindCRLFFunc)(const char *, size_t);
+typedef size_t (*FindAnyFunc)(const char *, size_t, const char *, int, size_t *, size_t);
+
+static const char *ScalarCRLF(const char *data, size_t len) { return ByteScan::FindDoubleCRLFScalar(data, len, 0); }
+static size_t ScalarAny(const char *data, size_t len, const char *delims, int ndelims, size_t *offsets, size_t max)
+{
+    return ByteScan::FindAnyScalar(data, len, 0, delims, ndelims, offsets, 0, max);
+}
+
+static std::vector<FindCRLFFunc> g_crlf;
+static std::vector<FindAnyFunc> g_any;
+
+static void InitImpls()
+{
+    g_crlf.push_back(ByteScan::FindDoubleCRLF);
+    g_any.push_back(ByteScan::FindAny);
+#ifdef BYTESCAN_X86
+    g_crlf.push_back(ByteScan::FindDoubleCRLFSse2);
+    g_any.push_back(ByteScan::FindAnySse2);
+    if (ByteScan::HasAvx2())
+    {
+        g_crlf.push_back(ByteScan::FindDoubleCRLFAvx2);
+        g_any.push_back(ByteScan::FindAnyAvx2);
+    }
+#endif
+    DBG_LOG("%d implementations to check", (int)g_crlf.size());
+}
+
+// 数据放在刚好len字节的堆内存中，越界读取在-fsanitize=address下会被发现
+static void CheckCRLF(const std::string &s)
+{
+    char *data = new char[s.size() + 1] + 1; // 多分配1字节并跳过，让起始地址不对齐
+    memcpy(data, s.data(), s.size());
+    const char *expect = ScalarCRLF(data, s.size());
+    for (auto func : g_crlf)
+        assert(func(data, s.size()) == expect);
+    delete[] (data - 1);
+}
+
+static void CheckAny(const std::string &s, const char *delims, int ndelims)
+{
+    char *data = new char[s.size() + 1] + 1;
+    memcpy(data, s.data(), s.size());
+    size_t expect[128], offsets[128];
+    size_t total = ScalarAny(data, s.size(), delims, ndelims, expect, 128);
+    for (auto func : g_any)
+    {
+        // max从1到total+1，覆盖在向量块中间数满返回的情况
+        for (size_t max = 1; max <= total + 1 && max <= 128; max++)
+        {
+            size_t n = func(data, s.size(), delims, ndelims, offsets, max);
+            assert(n == (total < max ? total : max));
+            for (size_t i = 0; i < n; i++)
+                assert(offsets[i] == expect[i]);
+        }
+    }
+    delete[] (data - 1);
+}
+
+// 长度0~80（覆盖16/32字节的整块和尾部），每个可能的匹配位置都放一次
+static void TestPositions()
+{
+    for (size_t len = 0; len <= 80; len++)
+    {
+        CheckCRLF(std::string(len, 'a'));
+        for (size_t p = 0; p + 4 <= len; p++)
+        {
+            std::string s(len, 'a');
+            s.replace(p, 4, "\r\n\r\n");
+            CheckCRLF(s);
+            // 前面再放一个不完整的"\r\n\r"，匹配只能从后面开始
+            if (p >= 3)
+            {
+                s.replace(p - 3, 3, "\r\n\r");
+                CheckCRLF(s);
+            }
+        }
+        for (size_t p = 0; p < len; p++)
+        {
+            for (size_t q = p; q < len; q++)
+            {
+                std::string s(len, 'a');
+                s[p] = ':';
+                s[q] = '\n';
+                CheckAny(s, ":\n", 2);
+                CheckAny(s, "\n", 1);
+                CheckAny(s, ":\r\n", 3);
+                CheckAny(s, "x:y\n", 4);
+            }
+        }
+    }
+}
+
+// 随机数据，分隔符很密集，匹配经常跨越向量块的边界
+static void TestRandom()
+{
+    const char chars[] = "\r\n:a";
+    srand(1);
+    for (int round = 0; round < 20000; round++)
+    {
+        size_t len = rand() % 160;
+        std::string s(len, 'a');
+        for (size_t i = 0; i < len; i++)
+            s[i] = chars[rand() % 4];
+        CheckCRLF(s);
+        CheckAny(s, ":\n", 2);
+    }
+}
+
+// 按RecvHttpHead的方式每次最多记录HEAD_SCAN_BATCH个位置，从最后一个位置之后继续查找
+static void TestResume()
+{
+    std::string s;
+    for (int i = 0; i < 300; i++)
+        s += "Key" + std::to_string(i) + ": v:" + std::string(i % 40, 'x') + "\r\n";
+    size_t *expect = new size_t[s.size()];
+    size_t total = ScalarAny(s.data(), s.size(), ":\n", 2, expect, s.size());
+    assert(total > 3 * HEAD_SCAN_BATCH);
+    for (auto func : g_any)
+    {
+        size_t offsets[HEAD_SCAN_BATCH];
+        size_t pos = 0, found = 0;
+        while (pos < s.size())
+        {
+            size_t n = func(s.data() + pos, s.size() - pos, ":\n", 2, offsets, HEAD_SCAN_BATCH);
+            for (size_t i = 0; i < n; i++)
+                assert(pos + offsets[i] == expect[found++]);
+            if (n < HEAD_SCAN_BATCH)
+                break;
+            pos += offsets[n - 1] + 1;
+        }
+        assert(found == total);
+    }
+    delete[] expect;
+}
+
+static std::string MakeRequest(int headers, const char *eol)
+{
+    std::string s = std::string("GET /index.html HTTP/1.1") + eol;
+    for (int i = 0; i < headers; i++)
+        s += "Key" + std::to_string(i) + ": http://host:" + std::to_string(i) + eol;
+    s += std::string("Content-Length: 12") + eol + eol;
+    s += "ab:\r\n\r\ncd:\n\n"; // 正文中的分隔符不能被当作头部
+    return s;
+}
+
+static void CheckRequest(HttpContext &ctx, int headers)
+{
+    assert(ctx.RecvStatu() == RECV_HTTP_OVER);
+    assert(ctx.RespStatu() == 200);
+    HttpRequest &req = ctx.Request();
+    assert(req._method == "GET" && req._path == "/index.html");
+    assert(req._headers.size() == (size_t)headers + 1);
+    for (int i = 0; i < headers; i++)
+        assert(req.GetHeader("Key" + std::to_string(i)) == "http://host:" + std::to_string(i));
+    assert(req._body == "ab:\r\n\r\ncd:\n\n");
+}
+
+// 完整的头部、只用\n换行的头部、分成两段/逐字节到达的头部
+static void TestHttpHead()
+{
+    const char *eols[] = {"\r\n", "\n"};
+    for (const char *eol : eols)
+    {
+        // 200个头部，超过HEAD_SCAN_BATCH个分隔符，要分多批扫描
+        std::string s = MakeRequest(200, eol);
+        {
+            Buffer buf;
+            HttpContext ctx;
+            buf.WriteStringAndPush(s);
+            ctx.RecvHttpRequest(&buf);
+            CheckRequest(ctx, 200);
+            assert(buf.ReadAbleSize() == 0);
+        }
+        {
+            Buffer buf;
+            HttpContext ctx;
+            for (size_t i = 0; i < s.size(); i++)
+            {
+                buf.WriteAndPush(&s[i], 1);
+                ctx.RecvHttpRequest(&buf);
+                assert(ctx.RecvStatu() != RECV_HTTP_ERROR);
+            }
+            CheckRequest(ctx, 200);
+        }
+        s = MakeRequest(5, eol);
+        for (size_t k = 0; k <= s.size(); k++)
+        {
+            Buffer buf;
+            HttpContext ctx;
+            buf.WriteStringAndPush(s.substr(0, k));
+            ctx.RecvHttpRequest(&buf);
+            buf.WriteStringAndPush(s.substr(k));
+            ctx.RecvHttpRequest(&buf);
+            CheckRequest(ctx, 5);
+        }
+    }
+    // 第一个':'后面不是空格，按": "分割
+    {
+        Buffer buf;
+        HttpContext ctx;
+        buf.WriteStringAndPush("GET / HTTP/1.1\r\nX:y: z\r\n\r\n");
+        ctx.RecvHttpRequest(&buf);
+        assert(ctx.RecvStatu() == RECV_HTTP_OVER);
+        assert(ctx.Request().GetHeader("X:y") == "z");
+    }
+}
+
+static void ExpectError(const std::string &s, int statu)
+{
+    Buffer buf;
+    HttpContext ctx;
+    buf.WriteStringAndPush(s);
+    ctx.RecvHttpRequest(&buf);
+    assert(ctx.RecvStatu() == RECV_HTTP_ERROR);
+    assert(ctx.RespStatu() == statu);
+}
+
+static void TestHttpError()
+{
+    std::string line = "GET / HTTP/1.1\r\n";
+    // 400：没有": "
+    ExpectError(line + "Bad\r\n\r\n", 400);
+    ExpectError(line + "Key:val\r\n\r\n", 400);
+    ExpectError(line + "A: b\nBad\n\n", 400);
+    // 414：一行刚好MAX_LINE字节（包括换行）可以接受，多一个字节就不行
+    std::string head = "K: " + std::string(MAX_LINE - 5, 'v') + "\r\n";
+    {
+        Buffer buf;
+        HttpContext ctx;
+        buf.WriteStringAndPush(line + head + "\r\n");
+        ctx.RecvHttpRequest(&buf);
+        assert(ctx.RecvStatu() == RECV_HTTP_OVER);
+        assert(ctx.Request().GetHeader("K").size() == MAX_LINE - 5);
+    }
+    ExpectError(line + "K: v" + head + "\r\n", 414);
+    // 414：还没收到换行，但是已经超过了MAX_LINE
+    ExpectError(line + "A: b\r\nK: " + std::string(MAX_LINE, 'v'), 414);
+    {
+        Buffer buf;
+        HttpContext ctx;
+        buf.WriteStringAndPush(line + "A: b\r\nK: " + std::string(MAX_LINE - 10, 'v'));
+        ctx.RecvHttpRequest(&buf);
+        assert(ctx.RecvStatu() == RECV_HTTP_HEAD);
+    }
+}
+
+int main()
+{
+    InitImpls();
+    TestPositions();
+    TestRandom();
+    TestResume();
+    TestHttpHead();
+    TestHttpError();
+    DBG_LOG("all passed");
+    return 0;
+}
@@ -0,0 +1,229 @@
+#include "../../source/Connection.hpp"
+
+#include <cstdlib>
+
+// ChainBuffer和一个std::string对照：块边界上的读写、只剩一个块时的Clear/Shrink、Iovec截断、跨块查找换行
+
+static std::string Pattern(size_t len, size_t seed)
+{
+    std::string s(len, 0);
+    for (size_t i = 0; i < len; i++)
+        s[i] = 'a' + (i + seed) % 26;
+    return s;
+}
+
+// 缓冲区的内容和model一致：Iovec取出的每一段依次拼起来就是model，除了首尾每一段都是整块
+static void CheckSame(ChainBuffer &buf, const std::string &model)
+{
+    assert(buf.ReadAbleSize() == model.size());
+    assert(buf.ReadAsString(model.size()) == model);
+    struct iovec iov[512];
+    int count = buf.Iovec(iov, 512);
+    std::string joined;
+    for (int i = 0; i < count; i++)
+    {
+        assert(iov[i].iov_len > 0);
+        if (i > 0 && i < count - 1)
+            assert(iov[i].iov_len == CHAIN_BLOCK_DATA);
+        joined.append((const char *)iov[i].iov_base, iov[i].iov_len);
+    }
+    assert(joined == model);
+    size_t pos = model.find('\n');
+    assert(buf.FindCRLF() == (pos == std::string::npos ? -1 : (int64_t)pos));
+}
+
+static void TestBoundary()
+{
+    size_t sizes[] = {1, CHAIN_BLOCK_DATA - 1, CHAIN_BLOCK_DATA, CHAIN_BLOCK_DATA + 1, 2 * CHAIN_BLOCK_DATA,
+                      3 * CHAIN_BLOCK_DATA + 5};
+    for (size_t size : sizes)
+    {
+        // 一次写入，按整块读出
+        ChainBuffer buf;
+        std::string model = Pattern(size, size);
+        buf.WriteStringAndPush(model);
+        CheckSame(buf, model);
+        struct iovec iov[8];
+        assert(buf.Iovec(iov, 8) == (int)((size + CHAIN_BLOCK_DATA - 1) / CHAIN_BLOCK_DATA));
+        while (model.size() > 0)
+        {
+            size_t n = model.size() < CHAIN_BLOCK_DATA ? model.size() : CHAIN_BLOCK_DATA;
+            assert(buf.ReadAsStringAndPop(n) == model.substr(0, n));
+            model.erase(0, n);
+            CheckSame(buf, model);
+        }
+        // 读空之后保留的块继续使用
+        model = Pattern(size, 7);
+        buf.WriteStringAndPush(model);
+        CheckSame(buf, model);
+    }
+    // 每次写入刚好写满一个块，读取的长度跨越块边界
+    {
+        ChainBuffer buf;
+        std::string model;
+        for (int i = 0; i < 4; i++)
+        {
+            std::string s = Pattern(CHAIN_BLOCK_DATA, i);
+            buf.WriteStringAndPush(s);
+            model += s;
+            CheckSame(buf, model);
+        }
+        while (model.size() > 0)
+        {
+            size_t n = model.size() < 5000 ? model.size() : 5000;
+            char out[5000];
+            buf.ReadAndPop(out, n);
+            assert(model.compare(0, n, out, n) == 0);
+            model.erase(0, n);
+            CheckSame(buf, model);
+        }
+    }
+}
+
+// 随机的写入和读取，长度经常落在块边界附近
+static void TestRandom()
+{
+    ChainBuffer buf;
+    std::string model;
+    srand(1);
+    for (int round = 0; round < 3000; round++)
+    {
+        size_t len = rand() % 3 == 0 ? CHAIN_BLOCK_DATA - 2 + rand() % 5 : rand() % 6000;
+        if (rand() % 2)
+        {
+            std::string s = Pattern(len, round);
+            if (len > 0 && rand() % 4 == 0)
+                s[rand() % len] = '\n';
+            buf.WriteStringAndPush(s);
+            model += s;
+        }
+        else
+        {
+            len = len < model.size() ? len : model.size();
+            buf.MoveReadOffset(len);
+            model.erase(0, len);
+        }
+        CheckSame(buf, model);
+    }
+}
+
+// 只剩最后一个块时：Shrink在有数据时什么都不做，Clear保留这个块，没有数据时Shrink把它还给池
+static void TestClearShrink()
+{
+    BufferPool *pool = BufferPool::Local();
+    ChainBuffer buf;
+    std::string model = Pattern(CHAIN_BLOCK_DATA + 10, 0);
+    buf.WriteStringAndPush(model);
+    uint64_t cached = pool->CachedBytes();
+    buf.MoveReadOffset(CHAIN_BLOCK_DATA);
+    assert(pool->CachedBytes() == cached + CHAIN_BLOCK_SIZE); // 读完的第一个块已经释放
+    model.erase(0, CHAIN_BLOCK_DATA);
+    CheckSame(buf, model);
+
+    cached = pool->CachedBytes();
+    buf.Shrink();
+    assert(pool->CachedBytes() == cached);
+    CheckSame(buf, model);
+
+    buf.Clear();
+    assert(pool->CachedBytes() == cached);
+    CheckSame(buf, "");
+    buf.WriteStringAndPush("abc\n");
+    assert(pool->CachedBytes() == cached); // 写入复用了保留的块
+    CheckSame(buf, "abc\n");
+
+    buf.Clear();
+    buf.Shrink();
+    assert(pool->CachedBytes() == cached + CHAIN_BLOCK_SIZE);
+    CheckSame(buf, "");
+    buf.Shrink();
+    buf.Clear();
+    CheckSame(buf, "");
+    buf.WriteStringAndPush("xyz");
+    CheckSame(buf, "xyz");
+
+    // 多个块时Clear只保留一个
+    buf.WriteStringAndPush(Pattern(3 * CHAIN_BLOCK_DATA, 1));
+    cached = pool->CachedBytes();
+    buf.Clear();
+    assert(pool->CachedBytes() == cached + 3 * CHAIN_BLOCK_SIZE);
+    CheckSame(buf, "");
+}
+
+// 超过CONN_IOV_MAX个块时Iovec只取出前CONN_IOV_MAX段，发送掉之后再取后面的
+static void TestIovec()
+{
+    ChainBuffer buf;
+    std::string model = Pattern(70 * CHAIN_BLOCK_DATA + 3, 0);
+    buf.WriteStringAndPush(model);
+    buf.MoveReadOffset(100);
+    model.erase(0, 100);
+    struct iovec iov[CONN_IOV_MAX];
+    int count = buf.Iovec(iov, CONN_IOV_MAX);
+    assert(count == CONN_IOV_MAX);
+    size_t total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        assert(memcmp(iov[i].iov_base, model.data() + total, iov[i].iov_len) == 0);
+        total += iov[i].iov_len;
+    }
+    assert(total == CONN_IOV_MAX * CHAIN_BLOCK_DATA - 100);
+    buf.MoveReadOffset(total);
+    model.erase(0, total);
+    count = buf.Iovec(iov, CONN_IOV_MAX);
+    assert(count == 7);
+    CheckSame(buf, model);
+    assert(buf.Iovec(iov, 1) == 1 && iov[0].iov_len == CHAIN_BLOCK_DATA);
+}
+
+// 换行在后一个块的第一个字节、前一个块的最后一个字节
+static void TestFindCRLF()
+{
+    {
+        ChainBuffer buf;
+        buf.WriteStringAndPush(std::string(CHAIN_BLOCK_DATA, 'a'));
+        assert(buf.FindCRLF() == -1 && buf.GetLine() == "");
+        buf.WriteStringAndPush("\nrest");
+        assert(buf.FindCRLF() == CHAIN_BLOCK_DATA);
+        buf.MoveReadOffset(5);
+        assert(buf.FindCRLF() == CHAIN_BLOCK_DATA - 5);
+        assert(buf.GetLineAndPop() == std::string(CHAIN_BLOCK_DATA - 5, 'a') + "\n");
+        assert(buf.ReadAsStringAndPop(4) == "rest");
+        assert(buf.ReadAbleSize() == 0);
+    }
+    {
+        ChainBuffer buf;
+        buf.WriteStringAndPush(std::string(CHAIN_BLOCK_DATA - 1, 'a') + "\n" + "b\n");
+        assert(buf.FindCRLF() == CHAIN_BLOCK_DATA - 1);
+        assert(buf.GetLineAndPop().size() == CHAIN_BLOCK_DATA);
+        assert(buf.GetLineAndPop() == "b\n");
+        assert(buf.GetLineAndPop() == "");
+    }
+}
+
+// 移动之后块归新对象所有，原对象为空并且可以继续使用
+static void TestMove()
+{
+    ChainBuffer a;
+    std::string model = Pattern(2 * CHAIN_BLOCK_DATA + 1, 3);
+    a.WriteStringAndPush(model);
+    ChainBuffer b(std::move(a));
+    CheckSame(a, "");
+    CheckSame(b, model);
+    a.WriteStringAndPush("abc");
+    b = std::move(a);
+    CheckSame(a, "");
+    CheckSame(b, "abc");
+}
+
+int main()
+{
+    TestBoundary();
+    TestRandom();
+    TestClearShrink();
+    TestIovec();
+    TestFindCRLF();
+    TestMove();
+    DBG_LOG("all passed");
+    return 0;
+}